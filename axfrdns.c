@@ -61,7 +61,9 @@
 static char *prog = NULL;
 short mode = 0, debug_level = 0;
 
-extern int respond (char *, char *, char *);
+extern int respond (struct response *, char *, char *, char *);
+
+static struct response resp;
 static char *cfgfile = CFGFILE, *logfile = LOGFILE, *pidfile = PIDFILE;
 
 int
@@ -603,17 +605,17 @@ main (int argc, char *argv[])
         }
         else
         {
-            if (!response_query (zone, qtype, qclass))
+            if (!response_query (&resp, zone, qtype, qclass))
                 err (-1, "could not allocate enough memory");
-            response[2] |= 4;
+            resp.buf[2] |= 4;
             case_lowerb (zone, zonelen);
-            response_id (header);
-            response[3] &= ~128;
+            response_id (&resp, header);
+            resp.buf[3] &= ~128;
             if (!(header[2] & 1))
-                response[2] &= ~1;
-            if (!respond (zone, qtype, ip))
+                resp.buf[2] &= ~1;
+            if (!respond (&resp, zone, qtype, ip))
                 errx (-1, "could not find information in file `data.cdb'");
-            print (response, response_len);
+            print (resp.buf, resp.len);
         }
     }
 }
@@ -0,0 +1,199 @@
+/*
+ * clientstat.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "dns.h"
+#include "byte.h"
+#include "taia.h"
+#include "uint32.h"
+#include "uint64.h"
+#include "siphash.h"
+#include "clientstat.h"
+
+/*
+ * Per client statistics: how fast each client has been asking questions,
+ * and how many of its questions dnscache is working on. A client is an
+ * address, or a network of the configured prefix length, kept in a small
+ * set-associative table like the zones in zonestat.c. When a set is full,
+ * the least recently seen client with no queries in flight is forgotten;
+ * if there is none the new client simply goes uncounted.
+ *
+ * The rate is a token bucket: a client may ask `burst' questions at once,
+ * and one more every 1/`rate' of a second after that. Forgetting a client
+ * that has been quiet for long enough loses nothing, its bucket was full
+ * again anyway. A client may also have at most `max' queries in flight,
+ * so that one of them can not take up all the slots for recursion.
+ */
+
+#define CLIENT_WAYS 4
+#define CLIENT_SLOTS 4096           /* power of 2 */
+
+struct client
+{
+    uint32 net;                     /* network, in host byte order */
+    uint32 inflight;                /* queries in progress */
+    uint64 tokens;                  /* questions allowed now, x 1000 */
+    uint64 stamp;                   /* millisecond of last use, 0 if free */
+};
+
+static struct client client[CLIENT_SLOTS];
+static unsigned char client_key[16];
+static unsigned int client_rate;
+static unsigned int client_burst;
+static uint32 client_mask;
+static unsigned int client_max;
+uint64 client_limited = 0;          /* questions over the rate */
+uint64 client_capped = 0;           /* queries over the in flight limit */
+
+/*
+ * client_init: allow each network of `prefix' bits, 0 to 32, `rate'
+ * questions per second with bursts of `burst', and `max' queries in
+ * flight; 0 for no limit.
+ */
+void
+client_init (unsigned int rate, unsigned int burst,
+                        unsigned int prefix, unsigned int max)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < sizeof (client_key); i++)
+        client_key[i] = (unsigned char) dns_random (0x100);
+
+    /* all of 0 to 32; a shift by 32 bits is undefined */
+    client_mask = prefix ? 0xffffffff << (32 - prefix) : 0;
+    client_rate = rate;
+    client_burst = (burst > rate) ? burst : rate;
+    client_max = max;
+}
+
+static struct client *
+client_find (const char ip[4], int create)
+{
+    uint32 net = 0;
+    uint64 h = 0, ms = 0;
+    struct taia now;
+    unsigned int i = 0;
+    char buf[4];
+    struct client *e = 0, *old = 0;
+
+    uint32_unpack_big (ip, &net);
+    net &= client_mask;
+    uint32_pack_big (buf, net);
+    siphash24 ((unsigned char *)&h, (const unsigned char *)buf, 4, client_key);
+
+    taia_now (&now);
+    ms = now.sec.x * 1000 + now.nano / 1000000;
+    e = client + (h & (CLIENT_SLOTS - CLIENT_WAYS));
+    for (i = 0; i < CLIENT_WAYS; i++)
+    {
+        if (e[i].stamp && e[i].net == net)
+        {
+            old = e + i;
+            break;
+        }
+        if (e[i].inflight)
+            continue;
+        if (!old || !e[i].stamp || (old->stamp && e[i].stamp < old->stamp))
+            old = e + i;
+    }
+    if (!old)
+        return 0;
+
+    if (!old->stamp || old->net != net)
+    {
+        if (!create)
+            return 0;
+        byte_zero (old, sizeof (*old));
+        old->net = net;
+        old->tokens = (uint64)client_burst * 1000;
+    }
+    else if (ms > old->stamp)
+    {
+        old->tokens += (ms - old->stamp) * client_rate;
+        if (old->tokens > (uint64)client_burst * 1000)
+            old->tokens = (uint64)client_burst * 1000;
+    }
+    old->stamp = ms ? ms : 1;
+
+    return old;
+}
+
+/*
+ * client_query: take a token for a question from `ip'. Returns 0 if the
+ * client is asking faster than it may, and the question should be dropped.
+ */
+int
+client_query (const char *ip)
+{
+    struct client *e = 0;
+
+    if (!client_rate)
+        return 1;
+    if (!(e = client_find (ip, 1)))
+        return 1;
+    if (e->tokens < 1000)
+    {
+        client_limited++;
+        return 0;
+    }
+    e->tokens -= 1000;
+
+    return 1;
+}
+
+/* client_busy: return 1 if `ip' already has the maximum queries in flight */
+int
+client_busy (const char *ip)
+{
+    struct client *e = 0;
+
+    if (!client_max)
+        return 0;
+    if (!(e = client_find (ip, 0)) || e->inflight < client_max)
+        return 0;
+
+    client_capped++;
+    return 1;
+}
+
+/*
+ * client_hold: count a query from `ip' taking a slot. Every hold must be
+ * paired with client_release, when the slot is given up.
+ */
+void
+client_hold (const char *ip)
+{
+    struct client *e = 0;
+
+    if (!client_max)
+        return;
+    if ((e = client_find (ip, 1)))
+        e->inflight++;
+}
+
+void
+client_release (const char *ip)
+{
+    struct client *e = 0;
+
+    if (!client_max)
+        return;
+    if ((e = client_find (ip, 0)) && e->inflight)
+        e->inflight--;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "uint64.h"
+
+extern uint64 client_limited;
+extern uint64 client_capped;
+
+extern void client_init (unsigned int, unsigned int, unsigned int, unsigned int);
+
+extern int client_query (const char *);
+
+extern int client_busy (const char *);
+
+extern void client_hold (const char *);
+
+extern void client_release (const char *);
@@ -122,7 +122,10 @@ check_variable (const char *var)
         "AXFR", "DATALIMIT", "CACHESIZE", "IP", "IPSEND",
         "UID", "GID", "ROOT", "HIDETTL", "FORWARDONLY",
         "MERGEQUERIES", "DEBUG_LEVEL", "BASE", "TCPREMOTEIP",
-        "TCPREMOTEPORT"
+        "TCPREMOTEPORT", "MAXSERVERQUERIES", "MAXZONEQUERIES",
+        "ZONENXRATE", "TCPFASTOPEN", "IPSENDPORTS",
+        "LOCALDATA", "CLIENTRATE", "CLIENTBURST", "CLIENTPREFIX",
+        "CLIENTQUERIES", "RRLRATE", "RRLSLIP", "RRLPREFIX"
     };
 
     l = sizeof (known_variable) / sizeof (*known_variable);
@@ -0,0 +1,220 @@
+/*
+ * deleg.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "dns.h"
+#include "byte.h"
+#include "case.h"
+#include "taia.h"
+#include "deleg.h"
+#include "uint32.h"
+#include "uint64.h"
+#include "siphash.h"
+
+/*
+ * Delegation index: the zone cuts for which NS records sit in the cache,
+ * so that the deepest one enclosing a name is found without a cache probe
+ * for each of its suffixes. Once the addresses of a zone's servers have
+ * been worked out they are kept here too, for a little while, and the NS
+ * names need not be looked up again.
+ *
+ * Zones are identified by a keyed hash computed label by label from the
+ * root down, so that the hashes of all the suffixes of a name come out of
+ * a single pass over it. The table is set-associative; when a set is full
+ * the entry closest to expiry is replaced.
+ */
+
+#define DELEG_WAYS 4
+#define DELEG_SLOTS 8192            /* power of 2 */
+#define DELEG_ADDRTTL 120           /* seconds to keep server addresses */
+
+struct deleg
+{
+    uint64 id;                      /* 0 if the slot is free */
+    uint64 expire;                  /* NS records expire then */
+    uint64 addrexpire;              /* servers expire then, 0 if none */
+    char servers[64];
+};
+
+static struct deleg deleg[DELEG_SLOTS];
+static unsigned char deleg_key[16];
+
+void
+deleg_init (void)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < sizeof (deleg_key); i++)
+        deleg_key[i] = (unsigned char) dns_random (0x100);
+}
+
+static uint64
+deleg_now (void)
+{
+    struct taia now;
+
+    taia_now (&now);
+    return now.sec.x;
+}
+
+/*
+ * suffixes: hash every suffix of `d'. On return pos[i] is the offset of the
+ * i-th suffix within `d' and id[i] its hash, with i = 0 for `d' itself and
+ * i = n - 1 for the root. Returns n, or 0 if `d' is malformed.
+ */
+static unsigned int
+suffixes (const char *d, unsigned int pos[128], uint64 id[128])
+{
+    char buf[72];
+    uint64 h = 0;
+    unsigned int i = 0, j = 0, n = 0, len = 0;
+
+    while (d[i])
+    {
+        if (n >= 127)
+            return 0;
+        pos[n++] = i;
+        i += 1 + (unsigned char) d[i];
+        if (i > 254)
+            return 0;
+    }
+    pos[n++] = i;
+
+    siphash24 ((unsigned char *)&h, (const unsigned char *)"", 0, deleg_key);
+    id[n - 1] = h ? h : 1;
+    for (j = n - 1; j-- > 0; )
+    {
+        len = 1 + (unsigned char) d[pos[j]];
+        byte_copy (buf, 8, &h);
+        byte_copy (buf + 8, len, d + pos[j]);
+        case_lowerb (buf + 9, len - 1);
+        siphash24 ((unsigned char *)&h,
+                   (const unsigned char *)buf, 8 + len, deleg_key);
+        id[j] = h ? h : 1;
+    }
+
+    return n;
+}
+
+static uint64
+deleg_id (const char *zone)
+{
+    uint64 id[128];
+    unsigned int pos[128];
+
+    if (!suffixes (zone, pos, id))
+        return 0;
+
+    return id[0];
+}
+
+static struct deleg *
+deleg_lookup (uint64 id, uint64 now)
+{
+    unsigned int i = 0;
+    struct deleg *e = deleg + (id & (DELEG_SLOTS - DELEG_WAYS));
+
+    for (i = 0; i < DELEG_WAYS; i++)
+        if (e[i].id == id)
+            return (e[i].expire > now) ? e + i : 0;
+
+    return 0;
+}
+
+/* deleg_set: NS records for `zone' have been cached for `ttl' seconds */
+void
+deleg_set (const char *zone, uint32 ttl)
+{
+    unsigned int i = 0;
+    uint64 id = 0, now = 0;
+    struct deleg *e = 0, *old = 0;
+
+    if (!(id = deleg_id (zone)))
+        return;
+
+    now = deleg_now ();
+    e = deleg + (id & (DELEG_SLOTS - DELEG_WAYS));
+    for (i = 0; i < DELEG_WAYS; i++)
+    {
+        if (e[i].id == id)
+        {
+            old = e + i;
+            break;
+        }
+        if (!old || e[i].expire < old->expire)
+            old = e + i;
+    }
+
+    old->id = id;
+    old->expire = now + ttl;
+    old->addrexpire = 0;
+}
+
+/*
+ * deleg_setservers: the servers of `zone' were found to be `servers', from
+ * address records the first of which expires in `ttl' seconds.
+ */
+void
+deleg_setservers (const char *zone, const char servers[64], uint32 ttl)
+{
+    uint64 now = deleg_now ();
+    struct deleg *e = deleg_lookup (deleg_id (zone), now);
+
+    if (!e || e->addrexpire > now)
+        return;
+
+    byte_copy (e->servers, 64, servers);
+    e->addrexpire = now + ((ttl < DELEG_ADDRTTL) ? ttl : DELEG_ADDRTTL);
+    if (e->addrexpire > e->expire)
+        e->addrexpire = e->expire;
+}
+
+/*
+ * deleg_find: find the deepest zone cut enclosing `d' whose NS records are
+ * in the cache. Returns 0 if there is none. Otherwise `*pos' is set to the
+ * offset of that zone within `d', and the return value is 1, or 2 if its
+ * servers' addresses are known too; they are then copied to `servers'.
+ */
+int
+deleg_find (const char *d, unsigned int *pos, char servers[64])
+{
+    uint64 now = 0;
+    uint64 id[128];
+    struct deleg *e = 0;
+    unsigned int i = 0, n = 0, off[128];
+
+    if (!(n = suffixes (d, off, id)))
+        return 0;
+
+    now = deleg_now ();
+    for (i = 0; i < n; i++)
+    {
+        if (!(e = deleg_lookup (id[i], now)))
+            continue;
+
+        *pos = off[i];
+        if (e->addrexpire <= now)
+            return 1;
+
+        byte_copy (servers, 64, e->servers);
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "uint32.h"
+
+extern void deleg_init (void);
+
+extern void deleg_set (const char *, uint32);
+
+extern void deleg_setservers (const char *, const char *, uint32);
+
+extern int deleg_find (const char *, unsigned int *, char *);
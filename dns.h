@@ -54,8 +54,17 @@ struct dns_transmit {
   int s1; /* 0, or 1 + an open file descriptor */
   int tcpstate;
   unsigned int udploop;
+  unsigned int maxloop; /* 0, or give up on UDP once udploop reaches it */
   unsigned int curserver;
   struct taia deadline;
+  struct taia sent; /* when the current UDP query went out */
+  struct taia hedgesent;
+  unsigned int hedgeserver; /* 0, or 1 + server still awaited on s1 */
+  unsigned int held; /* bit i set: counted in flight to servers[4*i] */
+  unsigned int conn; /* 0, or 1 + pooled TCP connection in use */
+  unsigned int conngen; /* generation of that connection */
+  int connretry; /* pooled connection died under us once already */
+  int tfo; /* query went out with TCP Fast Open, outcome not yet counted */
   unsigned int pos;
   const char *servers;
   char localip[4];
@@ -67,23 +76,42 @@ struct dns_transmit {
 
 extern void dns_enable_merge(void (*logger)(const char *, const char *,
                                             const char *));
+extern void dns_enable_tcppool(void);
+extern void dns_transmit_reap(const struct taia *,struct taia *);
+extern void dns_enable_fastopen(void);
+extern int dns_transmit_sources(const char *,unsigned int);
+extern int dns_transmit_ports(unsigned int,unsigned int);
+extern unsigned long dns_tfo_ok;
+extern unsigned long dns_tfo_fail;
 
 extern void dns_random_init(const char *);
 extern unsigned int dns_random(unsigned int);
 
 extern void dns_sortip(char *,unsigned int);
 
+extern void dns_infra_rtt(const char *,const struct taia *,const struct taia *);
+extern void dns_infra_sortip(char *,unsigned int);
+extern unsigned int dns_infra_rto(const char *,unsigned int,unsigned int);
+extern void dns_infra_fail(const char *,const struct taia *);
+extern void dns_infra_ok(const char *);
+extern void dns_infra_maxinflight(unsigned int);
+extern int dns_infra_hold(const char *);
+extern void dns_infra_release(const char *);
+extern unsigned long dns_infra_capped;
+
 extern void dns_domain_free(char **);
 extern int dns_domain_copy(char **,const char *);
 extern unsigned int dns_domain_length(const char *);
 extern int dns_domain_equal(const char *,const char *);
 extern int dns_domain_suffix(const char *,const char *);
 extern unsigned int dns_domain_suffixpos(const char *,const char *);
+extern unsigned int dns_domain_hash(const char *,unsigned int,unsigned int);
 extern int dns_domain_fromdot(char **,const char *,unsigned int);
 extern int dns_domain_todot_cat(stralloc *,const char *);
 
 extern unsigned int dns_packet_copy(const char *,unsigned int,unsigned int,char *,unsigned int);
 extern unsigned int dns_packet_getname(const char *,unsigned int,unsigned int,char **);
+extern unsigned int dns_packet_copyname(const char *,unsigned int,unsigned int,char *);
 extern unsigned int dns_packet_skipname(const char *,unsigned int,unsigned int);
 
 extern int dns_transmit_start(struct dns_transmit *,const char *,int,const char *,const char *,const char *);
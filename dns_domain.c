@@ -120,3 +120,25 @@ dns_domain_suffixpos (const char *big, const char *little)
         big += c;
     }
 }
+
+/*
+ * dns_domain_hash: hash `len' bytes of a name at `buf', ignoring case, on
+ * to `h'; start a new hash with h = 5381. Names that dns_domain_equal
+ * hash alike.
+ */
+unsigned int
+dns_domain_hash (const char *buf, unsigned int len, unsigned int h)
+{
+    char ch = 0;
+    unsigned int i = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        ch = buf[i];
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 32;
+        h = (h * 33) ^ (unsigned char)ch;
+    }
+
+    return h;
+}
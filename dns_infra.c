@@ -0,0 +1,370 @@
+/*
+ * dns_infra.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "dns.h"
+#include "byte.h"
+#include "taia.h"
+#include "uint32.h"
+
+/*
+ * Infrastructure table: what we have learnt about each name server we talk
+ * to. It is a small set-associative hash table keyed by the server's IP
+ * address; when a set is full the least recently updated entry is reused.
+ *
+ * Round trip times are kept in milliseconds and smoothed as in RFC 6298,
+ * ie. srtt = 7/8 srtt + 1/8 sample and rttvar = 3/4 rttvar + 1/4 |delta|.
+ *
+ * A server that times out, refuses the connection or answers SERVFAIL
+ * INFRA_DEAD times in a row is considered dead and is tried only after
+ * all the others, for a backoff period that doubles with every further
+ * failure. The first good answer from it brings it back.
+ *
+ * The table also counts the queries outstanding to each server. With a
+ * limit set by dns_infra_maxinflight(), a server that already has that many
+ * is skipped, so that one slow server cannot tie up all of our sockets.
+ */
+
+#define INFRA_WAYS 4
+#define INFRA_SLOTS 1024            /* power of 2 */
+#define INFRA_STALE 900             /* seconds an estimate stays useful */
+#define INFRA_UNKNOWN 376           /* ms, expected rtt of a new server */
+#define INFRA_EXPLORE 16            /* try a random server 1 in 16 times */
+#define INFRA_RTOMIN 100            /* ms, shortest retransmit timeout */
+#define INFRA_DEAD 3                /* failures in a row to consider dead */
+#define INFRA_BACKOFF 2             /* seconds, first backoff period */
+#define INFRA_BACKOFFMAX 900        /* seconds, longest backoff period */
+
+struct infra
+{
+    char ip[4];
+    uint32 srtt;                    /* smoothed round trip time */
+    uint32 rttvar;                  /* round trip time variation */
+    uint32 fails;                   /* consecutive failures */
+    uint32 inflight;                /* queries outstanding */
+    struct taia backoff;            /* dead until then */
+    struct taia stamp;              /* last update, 0 if slot is free */
+};
+
+static struct infra infra[INFRA_SLOTS];
+static unsigned int infra_maxinflight;
+unsigned long dns_infra_capped;     /* queries not sent due to the limit */
+
+static unsigned int
+infra_set (const char ip[4])
+{
+    uint32 u = 0;
+
+    uint32_unpack (ip, &u);
+    u *= 2654435761U;
+
+    return (u >> 16) & (INFRA_SLOTS / INFRA_WAYS - 1);
+}
+
+static struct infra *
+infra_find (const char ip[4])
+{
+    unsigned int i = 0;
+    struct infra *e = infra + INFRA_WAYS * infra_set (ip);
+
+    for (i = 0; i < INFRA_WAYS; i++)
+        if (e[i].stamp.sec.x && byte_equal (e[i].ip, 4, ip))
+            return e + i;
+
+    return 0;
+}
+
+static struct infra *
+infra_new (const char ip[4])
+{
+    unsigned int i = 0;
+    struct infra *e = infra + INFRA_WAYS * infra_set (ip), *old = e;
+
+    /* keep entries with queries outstanding, their counts are still needed */
+    for (i = 0; i < INFRA_WAYS; i++)
+    {
+        if (!e[i].stamp.sec.x)
+        {
+            old = e + i;
+            break;
+        }
+        if (e[i].inflight && !old->inflight)
+            continue;
+        if ((!e[i].inflight && old->inflight)
+            || taia_less (&e[i].stamp, &old->stamp))
+            old = e + i;
+    }
+
+    byte_zero (old, sizeof (*old));
+    byte_copy (old->ip, 4, ip);
+
+    return old;
+}
+
+static uint32
+infra_ms (const struct taia *t)
+{
+    double d = taia_approx (t) * 1000.0;
+
+    if (d < 0.0)
+        return 0;
+    if (d > 3600000.0)
+        return 3600000;
+
+    return d;
+}
+
+static int
+infra_fresh (const struct infra *e, const struct taia *now)
+{
+    struct taia t;
+
+    taia_uint (&t, INFRA_STALE);
+    taia_add (&t, &t, &e->stamp);
+
+    return taia_less (now, &t);
+}
+
+/* record a round trip to server `ip': query sent at `sent', reply `now' */
+void
+dns_infra_rtt (const char ip[4], const struct taia *sent,
+                                 const struct taia *now)
+{
+    uint32 ms = 0, delta = 0;
+    struct taia t;
+    struct infra *e = 0;
+
+    if (!taia_less (sent, now))
+        taia_uint (&t, 0);
+    else
+        taia_sub (&t, now, sent);
+    ms = infra_ms (&t);
+
+    if (!(e = infra_find (ip)) || !infra_fresh (e, now))
+    {
+        if (!e)
+            e = infra_new (ip);
+        e->srtt = ms;
+        e->rttvar = ms / 2;
+    }
+    else
+    {
+        delta = (e->srtt > ms) ? e->srtt - ms : ms - e->srtt;
+        e->rttvar = (3 * e->rttvar + delta) / 4;
+        e->srtt = (7 * e->srtt + ms) / 8;
+    }
+    e->stamp = *now;
+}
+
+/* record a timeout, refused connection or SERVFAIL from server `ip' */
+void
+dns_infra_fail (const char ip[4], const struct taia *now)
+{
+    struct taia t;
+    unsigned int i = 0, n = 0;
+    struct infra *e = infra_find (ip);
+
+    if (!e)
+    {
+        e = infra_new (ip);
+        e->srtt = INFRA_UNKNOWN;
+        e->rttvar = INFRA_UNKNOWN / 2;
+    }
+    e->stamp = *now;
+    if (e->fails < 0xffff)
+        e->fails++;
+    if (e->fails < INFRA_DEAD)
+        return;
+
+    n = INFRA_BACKOFF;
+    for (i = INFRA_DEAD; i < e->fails && n < INFRA_BACKOFFMAX; i++)
+        n <<= 1;
+    if (n > INFRA_BACKOFFMAX)
+        n = INFRA_BACKOFFMAX;
+
+    taia_uint (&t, n);
+    taia_add (&e->backoff, now, &t);
+}
+
+/* record a good answer from server `ip' */
+void
+dns_infra_ok (const char ip[4])
+{
+    struct infra *e = infra_find (ip);
+
+    if (!e)
+        return;
+
+    e->fails = 0;
+    byte_zero (&e->backoff, sizeof (e->backoff));
+}
+
+void
+dns_infra_maxinflight (unsigned int n)
+{
+    infra_maxinflight = n;
+}
+
+/*
+ * dns_infra_hold: count a query going out to server `ip'. Returns 0, and
+ * counts nothing, if that server already has the maximum number of queries
+ * outstanding. Every successful hold must be paired with dns_infra_release.
+ */
+int
+dns_infra_hold (const char ip[4])
+{
+    struct taia now;
+    struct infra *e = 0;
+
+    if (!infra_maxinflight)
+        return 1;
+
+    if (!(e = infra_find (ip)))
+    {
+        taia_now (&now);
+        e = infra_new (ip);
+        e->srtt = INFRA_UNKNOWN;
+        e->rttvar = INFRA_UNKNOWN / 2;
+        e->stamp = now;
+    }
+    if (e->inflight >= infra_maxinflight)
+    {
+        dns_infra_capped++;
+        return 0;
+    }
+    e->inflight++;
+
+    return 1;
+}
+
+void
+dns_infra_release (const char ip[4])
+{
+    struct infra *e = 0;
+
+    if (!infra_maxinflight)
+        return;
+    if ((e = infra_find (ip)) && e->inflight)
+        e->inflight--;
+}
+
+static int
+infra_dead (const struct infra *e, const struct taia *now)
+{
+    return e->fails >= INFRA_DEAD && taia_less (now, &e->backoff);
+}
+
+/*
+ * expected round trip time to server `ip' in milliseconds, or
+ * INFRA_DEADKEY if it is backing off.
+ */
+#define INFRA_DEADKEY 0xfffffffe
+
+static uint32
+infra_expect (const char ip[4], const struct taia *now)
+{
+    const struct infra *e = infra_find (ip);
+
+    if (!e)
+        return INFRA_UNKNOWN;
+    if (infra_dead (e, now))
+        return INFRA_DEADKEY;
+    if (!infra_fresh (e, now))
+        return INFRA_UNKNOWN;
+
+    return e->srtt;
+}
+
+/*
+ * dns_infra_rto: retransmit timeout for server `ip' in milliseconds, ie.
+ * srtt + 4 * rttvar, doubled for every earlier round of attempts `loop'.
+ * It never exceeds `max', which is also used for servers we know nothing
+ * about.
+ */
+unsigned int
+dns_infra_rto (const char ip[4], unsigned int loop, unsigned int max)
+{
+    uint32 ms = 0;
+    struct taia now;
+    const struct infra *e = infra_find (ip);
+
+    taia_now (&now);
+    if (!e || !infra_fresh (e, &now))
+        return max;
+
+    ms = e->srtt + 4 * e->rttvar;
+    if (ms < INFRA_RTOMIN)
+        ms = INFRA_RTOMIN;
+    while (loop-- && ms < max)
+        ms <<= 1;
+
+    return ms < max ? ms : max;
+}
+
+/*
+ * dns_infra_sortip: order the `n' bytes of server addresses in `s' by their
+ * expected round trip time, closest first. Ties, and servers we have not
+ * heard from, stay in random order. Once in a while a random server is
+ * moved to the front, so that the estimates of the others stay fresh.
+ * Dead servers come after all the live ones; empty (0.0.0.0) slots last.
+ */
+void
+dns_infra_sortip (char *s, unsigned int n)
+{
+    char tmp[4];
+    struct taia now;
+    uint32 key[16], k = 0;
+    unsigned int i = 0, j = 0, m = 0;
+
+    n >>= 2;
+    if (n > 16)
+        n = 16;
+
+    dns_sortip (s, n << 2);
+    taia_now (&now);
+    for (i = 0; i < n; i++)
+    {
+        if (byte_equal (s + (i << 2), 4, "\0\0\0\0"))
+            key[i] = 0xffffffff;
+        else if ((key[i] = infra_expect (s + (i << 2), &now)) < INFRA_DEADKEY)
+            m++;
+    }
+
+    /* insertion sort; n is at most 16 */
+    for (i = 1; i < n; i++)
+    {
+        k = key[i];
+        byte_copy (tmp, 4, s + (i << 2));
+        for (j = i; j > 0 && key[j - 1] > k; j--)
+        {
+            key[j] = key[j - 1];
+            byte_copy (s + (j << 2), 4, s + ((j - 1) << 2));
+        }
+        key[j] = k;
+        byte_copy (s + (j << 2), 4, tmp);
+    }
+
+    if (m > 1 && !dns_random (INFRA_EXPLORE))
+    {
+        i = 1 + dns_random (m - 1);
+        byte_copy (tmp, 4, s);
+        byte_copy (s, 4, s + (i << 2));
+        byte_copy (s + (i << 2), 4, tmp);
+    }
+}
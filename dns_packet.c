@@ -32,14 +32,14 @@ unsigned int dns_packet_skipname(const char *buf,unsigned int len,unsigned int p
   return 0;
 }
 
-unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int pos,char **d)
+/* dns_packet_copyname: decode the name at pos into out, 255 bytes; no alloc */
+unsigned int dns_packet_copyname(const char *buf,unsigned int len,unsigned int pos,char *out)
 {
   unsigned int loop = 0;
   unsigned int state = 0;
   unsigned int firstcompress = 0;
   unsigned int where;
   unsigned char ch;
-  char name[255];
   unsigned int namelen = 0;
 
   for (;;) {
@@ -47,7 +47,7 @@ unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int po
     if (++loop >= 1000) goto PROTO;
 
     if (state) {
-      if (namelen + 1 > sizeof name) goto PROTO; name[namelen++] = ch;
+      if (namelen + 1 > 255) goto PROTO; out[namelen++] = ch;
       --state;
     }
     else {
@@ -60,14 +60,12 @@ unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int po
 	if (++loop >= 1000) goto PROTO;
       }
       if (ch >= 64) goto PROTO;
-      if (namelen + 1 > sizeof name) goto PROTO; name[namelen++] = ch;
+      if (namelen + 1 > 255) goto PROTO; out[namelen++] = ch;
       if (!ch) break;
       state = ch;
     }
   }
 
-  if (!dns_domain_copy(d,name)) return 0;
-
   if (firstcompress) return firstcompress;
   return pos;
 
@@ -75,3 +73,13 @@ unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int po
   errno = error_proto;
   return 0;
 }
+
+unsigned int dns_packet_getname(const char *buf,unsigned int len,unsigned int pos,char **d)
+{
+  char name[255];
+
+  pos = dns_packet_copyname(buf,len,pos,name);
+  if (!pos) return 0;
+  if (!dns_domain_copy(d,name)) return 0;
+  return pos;
+}
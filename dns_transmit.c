@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "dns.h"
 #include "byte.h"
@@ -104,6 +105,345 @@ unregister_inprogress (struct dns_transmit *d)
     }
 }
 
+/*
+ * Source addresses and ports for outgoing queries. By default a query goes
+ * out from the local address given to dns_transmit_start, on a random port
+ * above 1024. With several addresses set, each socket is bound to one of
+ * them at random, so that the queries are spread over all of them.
+ */
+#define MAXSOURCES 16
+
+static char sources[4 * MAXSOURCES];
+static unsigned int nsources;
+static unsigned int portlo = 1025;
+static unsigned int portnum = 64510;
+static int portfixed;
+
+/* dns_transmit_sources: send from the `n' addresses in `ips' */
+int
+dns_transmit_sources (const char *ips, unsigned int n)
+{
+    if (n > MAXSOURCES)
+        return -1;
+
+    byte_copy (sources, 4 * n, ips);
+    nsources = n;
+
+    return 0;
+}
+
+/* dns_transmit_ports: send from ports `lo' to `hi' inclusive */
+int
+dns_transmit_ports (unsigned int lo, unsigned int hi)
+{
+    if (!lo || lo > hi || hi > 65535)
+        return -1;
+
+    portlo = lo;
+    portnum = hi - lo + 1;
+    portfixed = 1;
+
+    return 0;
+}
+
+static void
+picksource (struct dns_transmit *d)
+{
+    if (nsources)
+        byte_copy (d->localip, 4, sources + 4 * dns_random (nsources));
+}
+
+/* randombind: bind `s', a socket of `d', to a source address and port */
+static int
+randombind (struct dns_transmit *d, int s)
+{
+    int j = 0;
+
+    picksource (d);
+    for (j = 0; j < 10; ++j)
+        if (!socket_bind4 (s, d->localip, portlo + dns_random (portnum)))
+            return 0;
+
+    if (portfixed)
+        return -1;
+    if (!socket_bind4 (s, d->localip, 0))
+        return 0;
+
+    return -1;
+}
+
+/*
+ * TCP connection pool, used when forwarding: queries that must go over
+ * TCP to the caches listed in servers/roots share a few long-lived
+ * connections, many of them in flight at once on each, matched to their
+ * responses by ID. A connection nobody has used for POOL_IDLE seconds is
+ * closed. When one dies under its queries they are retried, once, on a
+ * fresh connection to the same server.
+ */
+#define POOL_CONNS 16
+#define POOL_USERS 64
+#define POOL_IDLE 10
+
+struct tcpconn
+{
+    int s;                          /* 0, or 1 + an open file descriptor */
+    char ip[4];
+    int connected;
+    int tfo;                        /* Fast Open outcome not yet counted */
+    unsigned int gen;               /* bumped whenever s is closed */
+    struct taia idle;               /* close then, if still unused */
+    struct dns_transmit *writer;    /* whose query is partly written */
+    struct dns_transmit *user[POOL_USERS];
+    unsigned int users;
+    char lenbuf[2];
+    unsigned int pos;               /* bytes of the response read so far */
+    unsigned int len;               /* its length, once pos >= 2 */
+    char *packet;
+};
+
+static int pool_enable;
+static struct tcpconn pool[POOL_CONNS];
+
+void
+dns_enable_tcppool (void)
+{
+    pool_enable = 1;
+}
+
+/*
+ * TCP Fast Open: with it enabled, the query is sent along with the SYN to
+ * servers that gave us a cookie before, saving a round trip. The kernel
+ * falls back to a normal handshake by itself; dns_tfo_ok and dns_tfo_fail
+ * count how often the server did, and did not, accept the data in the SYN.
+ */
+static int fastopen_enable;
+unsigned long dns_tfo_ok;
+unsigned long dns_tfo_fail;
+
+void
+dns_enable_fastopen (void)
+{
+    fastopen_enable = 1;
+}
+
+static int
+fastopen (int s)
+{
+    return fastopen_enable && socket_fastopenconnect (s) == 0;
+}
+
+static void
+fastopencount (int s)
+{
+    if (socket_fastopened (s))
+        dns_tfo_ok++;
+    else
+        dns_tfo_fail++;
+}
+
+static void
+poolclose (struct tcpconn *c)
+{
+    if (!c->s)
+        return;
+
+    close (c->s - 1);
+    c->s = 0;
+    c->gen++;
+    c->connected = 0;
+    c->tfo = 0;
+    c->writer = 0;
+    c->users = 0;
+    c->pos = 0;
+    if (c->packet)
+        alloc_free (c->packet);
+    c->packet = 0;
+}
+
+static void
+pooldetach (struct dns_transmit *d)
+{
+    unsigned int i = 0;
+    struct tcpconn *c = 0;
+
+    if (!d->conn)
+        return;
+    c = pool + d->conn - 1;
+    d->conn = 0;
+    if (c->gen != d->conngen)
+        return;
+
+    for (i = 0; i < c->users; i++)
+    {
+        if (c->user[i] == d)
+        {
+            c->user[i] = c->user[--c->users];
+            break;
+        }
+    }
+    if (c->writer == d)
+    {
+        /* a query cut short would garble the stream */
+        if (d->pos)
+        {
+            poolclose (c);
+            return;
+        }
+        c->writer = 0;
+    }
+    if (!c->users)
+    {
+        taia_now (&c->idle);
+        c->idle.sec.x += POOL_IDLE;
+    }
+}
+
+/* poolattach: send the TCP query of `d' to `ip' over a pooled connection */
+static int
+poolattach (struct dns_transmit *d, const char ip[4])
+{
+    struct taia now;
+    unsigned int i = 0, k = 0;
+    struct tcpconn *c = 0, *empty = 0;
+
+    taia_now (&now);
+    for (i = 0; i < POOL_CONNS; i++)
+    {
+        if (pool[i].s && !pool[i].users && taia_less (&pool[i].idle, &now))
+            poolclose (pool + i);
+        if (!pool[i].s)
+        {
+            if (!empty)
+                empty = pool + i;
+            continue;
+        }
+        if (!c && byte_equal (pool[i].ip, 4, ip)
+            && pool[i].users < POOL_USERS)
+            c = pool + i;
+    }
+
+    if (!c)
+    {
+        if (!(c = empty))
+            return -1;
+
+        c->s = 1 + socket_tcp ();
+        if (!c->s)
+            return -1;
+        if (randombind (d, c->s - 1) == -1)
+        {
+            poolclose (c);
+            return -1;
+        }
+        c->tfo = fastopen (c->s - 1);
+        if (socket_connect4 (c->s - 1, ip, 53) == 0)
+            c->connected = 1;
+        else if (errno != error_inprogress && errno != error_wouldblock)
+        {
+            poolclose (c);
+            return -1;
+        }
+        byte_copy (c->ip, 4, ip);
+    }
+
+    /* an ID no other query on this connection is using */
+    do
+    {
+        d->query[2] = dns_random (256);
+        d->query[3] = dns_random (256);
+        for (k = 0; k < c->users; k++)
+            if (byte_equal (c->user[k]->query + 2, 2, d->query + 2))
+                break;
+    } while (k < c->users);
+
+    c->user[c->users++] = d;
+    d->conn = 1 + (c - pool);
+    d->conngen = c->gen;
+    d->tcpstate = 6;
+    d->pos = 0;
+    taia_uint (&d->deadline, 10);
+    taia_add (&d->deadline, &d->deadline, &now);
+
+    return 0;
+}
+
+/*
+ * dns_transmit_reap: close the pooled connections left idle past their
+ * time, and bring `deadline' forward to when the next one is due, so that
+ * they go even when no query comes along to notice.
+ */
+void
+dns_transmit_reap (const struct taia *now, struct taia *deadline)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < POOL_CONNS; i++)
+    {
+        if (!pool[i].s || pool[i].users)
+            continue;
+        if (!taia_less (now, &pool[i].idle))
+            poolclose (pool + i);
+        else if (taia_less (&pool[i].idle, deadline))
+            *deadline = pool[i].idle;
+    }
+}
+
+/* poolread: read what has arrived on `c' and hand responses to their queries */
+static int
+poolread (struct tcpconn *c)
+{
+    int r = 0;
+    uint16 len = 0;
+    unsigned int i = 0;
+    struct dns_transmit *d = 0;
+
+    for (;;)
+    {
+        if (c->pos < 2)
+            r = read (c->s - 1, c->lenbuf + c->pos, 2 - c->pos);
+        else
+            r = read (c->s - 1, c->packet + c->pos - 2, c->len - c->pos + 2);
+        if (r == -1 && (errno == error_again || errno == error_wouldblock))
+            return 0;
+        if (r <= 0)
+            return -1;
+        if (c->tfo)
+        {
+            fastopencount (c->s - 1);
+            c->tfo = 0;
+        }
+
+        c->pos += r;
+        if (c->pos == 2)
+        {
+            uint16_unpack_big (c->lenbuf, &len);
+            c->len = len;
+            if (c->len < 12 || !(c->packet = alloc (c->len)))
+                return -1;
+            continue;
+        }
+        if (c->pos < 2 || c->pos < c->len + 2)
+            continue;
+
+        for (i = 0; i < c->users; i++)
+        {
+            d = c->user[i];
+            if (d->tcpstate == 7 && !d->packet
+                && byte_equal (d->query + 2, 2, c->packet))
+                break;
+        }
+        if (i < c->users)
+        {
+            d->packet = c->packet;
+            d->packetlen = c->len;
+        }
+        else
+            alloc_free (c->packet);
+        c->packet = 0;
+        c->pos = 0;
+    }
+}
+
 static int
 serverwantstcp (const char *buf, unsigned int len)
 {
@@ -141,7 +481,7 @@ static int
 irrelevant (const struct dns_transmit *d, const char *buf, unsigned int len)
 {
     unsigned int pos = 0;
-    char out[12], *dn = NULL;
+    char out[12], dn[255];
 
     if (!(pos = dns_packet_copy (buf, len, 0, out, 12)))
         return 1;
@@ -152,14 +492,10 @@ irrelevant (const struct dns_transmit *d, const char *buf, unsigned int len)
     if (out[5] != 1)
         return 1;
 
-    if (!(pos = dns_packet_getname (buf, len, pos, &dn)))
+    if (!(pos = dns_packet_copyname (buf, len, pos, dn)))
         return 1;
     if (!dns_domain_equal (dn, d->query + 14))
-    {
-        alloc_free (dn);
         return 1;
-    }
-    alloc_free (dn);
 
     if (!(pos = dns_packet_copy (buf, len, pos, out, 4)))
         return 1;
@@ -216,13 +552,39 @@ queryfree (struct dns_transmit *d)
     d->query = 0;
 }
 
+static int
+serverhold (struct dns_transmit *d, unsigned int i)
+{
+    if (!dns_infra_hold (d->servers + 4 * i))
+        return 0;
+
+    d->held |= 1 << i;
+    return 1;
+}
+
+static void
+serverrelease (struct dns_transmit *d)
+{
+    unsigned int i = 0;
+
+    for (i = 0; d->held; i++)
+    {
+        if (d->held & (1 << i))
+            dns_infra_release (d->servers + 4 * i);
+        d->held &= ~(1 << i);
+    }
+}
+
 static void
 socketfree (struct dns_transmit *d)
 {
+    serverrelease (d);
+    pooldetach (d);
     if (!d->s1)
       return;
     close (d->s1 - 1);
     d->s1 = 0;
+    d->hedgeserver = 0;
 }
 
 void
@@ -233,32 +595,36 @@ dns_transmit_free (struct dns_transmit *d)
     packetfree (d);
 }
 
-static int
-randombind (struct dns_transmit *d)
-{
-    int j = 0;
-
-    for (j = 0; j < 10; ++j)
-        if (!socket_bind4 (d->s1 - 1, d->localip, 1025 + dns_random (64510)))
-            return 0;
-
-    if (!socket_bind4 (d->s1 - 1, d->localip, 0))
-        return 0;
+static const int timeouts[4] = { 1, 3, 11, 45 };
 
-    return -1;
+/*
+ * udpdeadline: wait for curserver no longer than its retransmit timeout,
+ * derived from the measured round trip time; see dns_infra_rto(). Servers
+ * we know nothing about get the full timeouts[udploop].
+ */
+static void
+udpdeadline (struct dns_transmit *d, const struct taia *now)
+{
+    struct taia t;
+    unsigned int ms = 0;
+
+    ms = dns_infra_rto (d->servers + 4 * d->curserver,
+                        d->udploop, 1000 * timeouts[d->udploop]);
+    taia_uint (&t, ms / 1000);
+    t.nano = (ms % 1000) * 1000000;
+    taia_add (&d->deadline, &t, now);
 }
 
-static const int timeouts[4] = { 1, 3, 11, 45 };
-
 static int
 thisudp (struct dns_transmit *d)
 {
+    int busy = 0;
     const char *ip = NULL;
 
     socketfree (d);
     mergefree (d);
 
-    while (d->udploop < 4)
+    while (d->udploop < (d->maxloop ? d->maxloop : 4))
     {
         for (; d->curserver < 16; ++d->curserver)
         {
@@ -271,6 +637,11 @@ thisudp (struct dns_transmit *d)
                         merge_logger (ip, d->qtype, d->query + 14);
                     return 0;
                 }
+                if (!serverhold (d, d->curserver))
+                {
+                    busy = 1;
+                    continue;
+                }
 
                 d->query[2] = dns_random (256);
                 d->query[3] = dns_random (256);
@@ -281,7 +652,7 @@ thisudp (struct dns_transmit *d)
                     dns_transmit_free (d);
                     return -1;
                 }
-                if (randombind (d) == -1)
+                if (randombind (d, d->s1 - 1) == -1)
                 {
                     dns_transmit_free (d);
                     return -1;
@@ -295,8 +666,8 @@ thisudp (struct dns_transmit *d)
                         struct taia now;
 
                         taia_now (&now);
-                        taia_uint (&d->deadline, timeouts[d->udploop]);
-                        taia_add (&d->deadline, &d->deadline, &now);
+                        d->sent = now;
+                        udpdeadline (d, &now);
                         d->tcpstate = 0;
                         if (merge_enable)
                             register_inprogress (d);
@@ -312,6 +683,8 @@ thisudp (struct dns_transmit *d)
     }
 
     dns_transmit_free (d);
+    if (busy)
+        errno = error_busy;
     return -1;
 }
 
@@ -329,9 +702,65 @@ nextudp (struct dns_transmit *d)
     return thisudp (d);
 }
 
+/* giveudp: stop waiting for curserver, and count that as its failure */
+static int
+giveudp (struct dns_transmit *d, const struct taia *now)
+{
+    dns_infra_fail (d->servers + 4 * d->curserver, now);
+    return nextudp (d);
+}
+
+/*
+ * hedgeudp: curserver did not answer within its retransmit timeout. Rather
+ * than giving up on it, send the same query to the next server from the
+ * same socket and accept whichever answer arrives first. The socket is
+ * disconnected so that it can receive from both servers.
+ *
+ * A server is only counted as failing when it is given up on: a late
+ * answer may be merely slower than its timeout, so the hedge is not. The
+ * server hedged against has then had two timeouts to answer in; the one
+ * hedged to only one, and is just moved on from.
+ */
+static int
+hedgeudp (struct dns_transmit *d, const struct taia *now)
+{
+    unsigned int i = 0;
+    const char *ip = NULL;
+
+    if (d->hedgeserver)
+    {
+        dns_infra_fail (d->servers + 4 * (d->hedgeserver - 1), now);
+        return nextudp (d);
+    }
+
+    for (i = d->curserver + 1; i < 16; ++i)
+        if (byte_diff (d->servers + 4 * i, 4, "\0\0\0\0"))
+            break;
+    if (i >= 16)
+        return giveudp (d, now);
+
+    ip = d->servers + 4 * i;
+    if (!serverhold (d, i))
+        return giveudp (d, now);
+    if (socket_disconnect (d->s1 - 1) == -1)
+        return giveudp (d, now);
+    if (socket_send4 (d->s1 - 1, d->query + 2, d->querylen - 2,
+                      ip, 53, d->localip) != (int)d->querylen - 2)
+        return giveudp (d, now);
+
+    d->hedgeserver = 1 + d->curserver;
+    d->hedgesent = d->sent;
+    d->curserver = i;
+    taia_now (&d->sent);
+    udpdeadline (d, &d->sent);
+
+    return 0;
+}
+
 static int
 thistcp (struct dns_transmit *d)
 {
+    int busy = 0;
     struct taia now;
     const char *ip = NULL;
 
@@ -343,6 +772,14 @@ thistcp (struct dns_transmit *d)
         ip = d->servers + 4 * d->curserver;
         if (byte_diff (ip, 4, "\0\0\0\0"))
         {
+            if (!serverhold (d, d->curserver))
+            {
+                busy = 1;
+                continue;
+            }
+            if (pool_enable && (d->query[4] & 1) && poolattach (d, ip) == 0)
+                return 0;
+
             d->query[2] = dns_random (256);
             d->query[3] = dns_random (256);
 
@@ -352,11 +789,12 @@ thistcp (struct dns_transmit *d)
                 dns_transmit_free (d);
                 return -1;
             }
-            if (randombind (d) == -1)
+            if (randombind (d, d->s1 - 1) == -1)
             {
                 dns_transmit_free (d);
                 return -1;
             }
+            d->tfo = fastopen (d->s1 - 1);
 
             taia_now (&now);
             taia_uint (&d->deadline, 10);
@@ -377,6 +815,8 @@ thistcp (struct dns_transmit *d)
     }
 
     dns_transmit_free(d);
+    if (busy)
+        errno = error_busy;
     return -1;
 }
 
@@ -394,6 +834,109 @@ nexttcp (struct dns_transmit *d)
     return thistcp (d);
 }
 
+/* pooldead: the pooled connection of `d' went away; try again, or move on */
+static int
+pooldead (struct dns_transmit *d)
+{
+    pooldetach (d);
+    if (d->connretry)
+        return nexttcp (d);
+
+    d->connretry = 1;
+    return thistcp (d);
+}
+
+static void
+poolio (struct dns_transmit *d, iopause_fd *x, struct taia *deadline)
+{
+    struct tcpconn *c = pool + d->conn - 1;
+
+    x->fd = c->s - 1;
+    x->events = (d->tcpstate == 6) ? IOPAUSE_WRITE : IOPAUSE_READ;
+    if (c->gen != d->conngen || d->packet)
+    {
+        x->fd = -1;
+        taia_now (deadline);
+        return;
+    }
+    if (taia_less (&d->deadline, deadline))
+        *deadline = d->deadline;
+}
+
+static int
+poolget (struct dns_transmit *d, const iopause_fd *x, const struct taia *when)
+{
+    int r = 0;
+    struct taia now;
+    struct tcpconn *c = pool + d->conn - 1;
+
+    if (c->gen != d->conngen)
+        return pooldead (d);
+
+    if (d->tcpstate == 6)
+    {
+        if (!c->connected && x->revents)
+        {
+            if (!socket_connected (c->s - 1))
+            {
+                dns_infra_fail (d->servers + 4 * d->curserver, when);
+                poolclose (c);
+                return nexttcp (d);
+            }
+            c->connected = 1;
+        }
+        if (c->connected && (!c->writer || c->writer == d))
+        {
+            c->writer = d;
+            r = write (c->s - 1, d->query + d->pos, d->querylen - d->pos);
+            if (r <= 0 && errno != error_again && errno != error_wouldblock
+                && errno != error_inprogress)
+            {
+                poolclose (c);
+                return pooldead (d);
+            }
+            if (r > 0)
+                d->pos += r;
+            if (d->pos == d->querylen)
+            {
+                c->writer = 0;
+                taia_now (&now);
+                taia_uint (&d->deadline, 10);
+                taia_add (&d->deadline, &d->deadline, &now);
+                d->tcpstate = 7;
+            }
+        }
+    }
+    else if (!d->packet && x->revents && poolread (c) == -1)
+    {
+        poolclose (c);
+        return pooldead (d);
+    }
+
+    if (!d->packet)
+    {
+        if (taia_less (when, &d->deadline))
+            return 0;
+        errno = error_timeout;
+        return nexttcp (d);
+    }
+
+    pooldetach (d);
+    if (irrelevant (d, d->packet, d->packetlen))
+        return nexttcp (d);
+    if (serverwantstcp (d->packet, d->packetlen))
+        return nexttcp (d);
+    if (serverfailed (d->packet, d->packetlen))
+    {
+        dns_infra_fail (d->servers + 4 * d->curserver, when);
+        return nexttcp (d);
+    }
+    dns_infra_ok (d->servers + 4 * d->curserver);
+
+    queryfree (d);
+    return 1;
+}
+
 int
 dns_transmit_start (struct dns_transmit *d, const char servers[64],
                     int flagrecursive, const char *q, const char qtype[2],
@@ -424,6 +967,8 @@ dns_transmit_start (struct dns_transmit *d, const char servers[64],
     byte_copy (d->localip, 4, localip);
 
     d->udploop = flagrecursive ? 1 : 0;
+    d->connretry = 0;
+    d->tfo = 0;
 
     if ((len + 16 > 512) || byte_equal (qtype, 2, DNS_T_ANY))
         return firsttcp (d);
@@ -434,6 +979,11 @@ dns_transmit_start (struct dns_transmit *d, const char servers[64],
 void
 dns_transmit_io (struct dns_transmit *d, iopause_fd *x, struct taia *deadline)
 {
+    if (d->conn)
+    {
+        poolio (d, x, deadline);
+        return;
+    }
     x->fd = d->s1 - 1;
 
     switch (d->tcpstate)
@@ -466,9 +1016,13 @@ int
 dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
                                           const struct taia *when)
 {
+    char ip[4];
+    uint16 port = 0;
     char udpbuf[4097];
+    struct taia now;
     unsigned char ch = 0;
-    int r = 0, fd = 0, i = 0;
+    struct in_addr odst;
+    int r = 0, fd = 0, i = 0, hedged = 0;
 
     fd = d->s1 - 1;
     errno = error_io;
@@ -477,6 +1031,8 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
         return 0;
     if (d->tcpstate == 0 && d->packet)
         return 1;
+    if (d->conn)
+        return poolget (d, x, when);
 
     if (!x->revents)
     {
@@ -484,7 +1040,11 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
             return 0;
         errno = error_timeout;
         if (d->tcpstate == 0)
-            return nextudp (d);
+        {
+            /* the answer, if any, takes at least this long */
+            dns_infra_rtt (d->servers + 4 * d->curserver, &d->sent, when);
+            return hedgeudp (d, when);
+        }
 
         return nexttcp (d);
     }
@@ -495,9 +1055,11 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
          * have attempted to send UDP query to each server udploop times
          * have sent query to curserver on UDP socket s
          */
-        r = recv (fd, udpbuf, sizeof (udpbuf), 0);
+        r = socket_recv4 (fd, udpbuf, sizeof (udpbuf), ip, &port, &odst);
         if (r <= 0)
         {
+            if (errno == error_connrefused)
+                dns_infra_fail (d->servers + 4 * d->curserver, when);
             if (errno == error_connrefused && d->udploop == 2)
                     return 0;
 
@@ -506,17 +1068,43 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
         if ((unsigned)r + 1 > sizeof (udpbuf))
             return 0;
 
+        if (port != 53)
+            return 0;
+        if (byte_diff (ip, 4, d->servers + 4 * d->curserver))
+        {
+            if (!d->hedgeserver)
+                return 0;
+            if (byte_diff (ip, 4, d->servers + 4 * (d->hedgeserver - 1)))
+                return 0;
+            hedged = 1;
+        }
         if (irrelevant (d, udpbuf, r))
             return 0;
+        if (hedged)
+        {
+            /* the server we had given up on answered after all */
+            struct taia t = d->sent;
+
+            i = d->curserver;
+            d->curserver = d->hedgeserver - 1;
+            d->hedgeserver = i + 1;
+            d->sent = d->hedgesent;
+            d->hedgesent = t;
+        }
+        /* `when' may be from before the caller waited for the answer */
+        taia_now (&now);
+        dns_infra_rtt (d->servers + 4 * d->curserver, &d->sent, &now);
         if (serverwantstcp (udpbuf, r))
             return firsttcp (d);
         if (serverfailed (udpbuf, r))
         {
-            if (d->udploop == 2)
+            dns_infra_fail (d->servers + 4 * d->curserver, when);
+            if (d->udploop == 2 || d->hedgeserver)
                 return 0;
 
             return nextudp (d);
         }
+        dns_infra_ok (d->servers + 4 * d->curserver);
         socketfree (d);
 
         d->packetlen = r;
@@ -554,7 +1142,10 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
          * pos not defined
          */
         if (!socket_connected (fd))
+        {
+            dns_infra_fail (d->servers + 4 * d->curserver, when);
             return nexttcp (d);
+        }
 
         d->pos = 0;
         d->tcpstate = 2;
@@ -569,6 +1160,8 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
          * of query
          */
         r = write (fd, d->query + d->pos, d->querylen - d->pos);
+        if (r == -1 && d->tfo && errno == error_inprogress)
+            return 0;   /* no cookie yet, the handshake goes first */
         if (r <= 0)
             return nexttcp (d);
 
@@ -595,6 +1188,11 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
         r = read (fd, &ch, 1);
         if (r <= 0)
             return nexttcp (d);
+        if (d->tfo)
+        {
+            fastopencount (fd);
+            d->tfo = 0;
+        }
 
         d->packetlen = ch;
         d->tcpstate = 4;
@@ -648,7 +1246,11 @@ dns_transmit_get (struct dns_transmit *d, const iopause_fd *x,
         if (serverwantstcp (d->packet, d->packetlen))
             return nexttcp(d);
         if (serverfailed (d->packet, d->packetlen))
+        {
+            dns_infra_fail (d->servers + 4 * d->curserver, when);
             return nexttcp(d);
+        }
+        dns_infra_ok (d->servers + 4 * d->curserver);
 
         queryfree(d);
         return 1;
@@ -0,0 +1,273 @@
+/*
+ * dnsbl-data.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "version.h"
+
+#include "dns.h"
+#include "byte.h"
+#include "open.h"
+#include "alloc.h"
+#include "dnsbl.h"
+#include "error.h"
+#include "getln.h"
+#include "buffer.h"
+#include "uint32.h"
+#include "stralloc.h"
+
+buffer b;
+int fd = 0;
+char bspace[1024];
+static char *prog = NULL;
+
+int fddb = 0;
+buffer bdb;
+char bdbspace[1024];
+
+int match = 1;
+static stralloc line;
+unsigned long linenum = 0;
+
+static uint64 *table;
+static unsigned int slots;          /* power of 2 */
+static unsigned int used;
+
+static void
+usage (void)
+{
+    printf ("Usage: %s [OPTIONS]\n",  prog);
+}
+
+static void
+printh (void)
+{
+    usage ();
+    printf ("\n Options:\n");
+    printf ("%-17s %s\n", "    -h --help", "print this help");
+    printf ("%-17s %s\n", "    -v --version", "print version information");
+    printf ("\nReport bugs to <pj.pandit@yahoo.co.in>\n");
+}
+
+static int
+check_option (int argc, char *argv[])
+{
+    int n = 0, ind = 0;
+    const char optstr[] = "+:hv";
+    struct option lopt[] = \
+    {
+        { "help", no_argument, NULL, 'h' },
+        { "version", no_argument, NULL, 'v' },
+        { 0, 0, 0, 0 }
+    };
+
+    opterr = optind = 0;
+    while ((n = getopt_long (argc, argv, optstr, lopt, &ind)) != -1)
+    {
+        switch (n)
+        {
+        case 'h':
+            printh ();
+            exit (0);
+
+        case 'v':
+            printf ("%s is part of ndjbdns version %s\n", prog, VERSION);
+            exit (0);
+
+        default:
+            errx (-1, "unknown option `%c', see: --help", optopt);
+        }
+    }
+
+    return optind;
+}
+
+static void
+insert (uint64 *t, unsigned int n, uint64 e)
+{
+    uint64 key = e & ~(uint64)DNSBL_SUBTREE;
+    unsigned int i = dnsbl_slot (key, n);
+
+    for (; t[i]; i = (i + 1) & (n - 1))
+    {
+        if ((t[i] & ~(uint64)DNSBL_SUBTREE) == key)
+        {
+            t[i] |= e;
+            return;
+        }
+    }
+    t[i] = e;
+    used++;
+}
+
+/* fromdot: parse the name of `len' bytes at `s' into `dn', or exit */
+static void
+fromdot (char **dn, const char *s, unsigned int len)
+{
+    if (dns_domain_fromdot (dn, s, len))
+        return;
+    if (errno == error_proto)
+        errx (-1, "could not parse line %lu: label or name too long", linenum);
+
+    err (-1, "could not allocate enough memory");
+}
+
+/* add: block the name `dn', and the names below it if `subtree' is set */
+static void
+add (const char *dn, int subtree)
+{
+    uint64 *t = 0;
+    unsigned int i = 0, n = 0;
+
+    /* keep the table at most half full */
+    if (2 * (used + 1) > slots)
+    {
+        n = slots ? 2 * slots : 1024;
+        if (!(t = (uint64 *)alloc (n * sizeof (uint64))))
+            err (-1, "could not allocate enough memory");
+        byte_zero (t, n * sizeof (uint64));
+
+        used = 0;
+        for (i = 0; i < slots; i++)
+            if (table[i])
+                insert (t, n, table[i]);
+        if (table)
+            alloc_free (table);
+        table = t;
+        slots = n;
+    }
+
+    insert (table, slots, dnsbl_hash (dn) | (subtree ? DNSBL_SUBTREE : 0));
+}
+
+static void
+put (const char *s, unsigned int len)
+{
+    if (buffer_put (&bdb, s, len) == -1)
+        err (-1, "could not write to file: `%s'", "dnsbl.tmp");
+}
+
+int
+main (int argc, char *argv[])
+{
+    char *x = NULL, ch = 0, buf[8];
+    static char *dn = NULL;
+    unsigned int i = 0, j = 0;
+    uint64 e = 0;
+
+    prog = strdup ((x = strrchr (argv[0], '/')) != NULL ? x + 1 : argv[0]);
+    check_option (argc, argv);
+
+    umask(022);
+    fd = open_read ("dnsbl");
+    if (fd == -1)
+        err (-1, "could not open file: `%s'", "dnsbl");
+    buffer_init (&b, buffer_unixread, fd, bspace, sizeof (bspace));
+
+    while (match)
+    {
+        ++linenum;
+        if (getln (&b, &line, &match, '\n') == -1)
+          err (-1, "could not read line");
+
+        while (line.len)
+        {
+            ch = line.s[line.len - 1];
+            if ((ch != ' ') && (ch != '\t') && (ch != '\r') && (ch != '\n'))
+                break;
+            --line.len;
+        }
+        if (!line.len)
+            continue;
+
+        switch (line.s[0])
+        {
+        case '#':
+            break;
+
+        case ':':
+            /* a generic record, as in the data for the old dnsbl.cdb */
+            j = byte_chr (line.s + 1, line.len - 1, ':');
+            fromdot (&dn, line.s + 1, j);
+            add (dn, 0);
+            break;
+
+        case '=':
+            fromdot (&dn, line.s + 1, line.len - 1);
+            add (dn, 0);
+            break;
+
+        default:
+            /* bad.example.com, .bad.example.com and *.bad.example.com */
+            i = (line.s[0] == '.') ? 1 : 0;
+            if (line.len > 1 && line.s[0] == '*' && line.s[1] == '.')
+                i = 2;
+            fromdot (&dn, line.s + i, line.len - i);
+            if (!*dn)
+                errx (-1, "could not parse line %lu: empty name", linenum);
+            add (dn, 1);
+            break;
+        }
+    }
+
+    fddb = open_trunc ("dnsbl.tmp");
+    if (fddb == -1)
+        err (-1, "could not open file: `%s'", "dnsbl.tmp");
+    buffer_init (&bdb, buffer_unixwrite, fddb, bdbspace, sizeof (bdbspace));
+
+    if (!slots)
+    {
+        /* an empty list still needs a table */
+        if (!(table = (uint64 *)alloc (16 * sizeof (uint64))))
+            err (-1, "could not allocate enough memory");
+        byte_zero (table, 16 * sizeof (uint64));
+        slots = 16;
+    }
+    put (DNSBL_MAGIC, 8);
+    uint32_pack (buf, slots);
+    uint32_pack (buf + 4, 0);
+    put (buf, 8);
+    for (i = 0; i < slots; i++)
+    {
+        e = table[i];
+        for (j = 0; j < 8; j++, e >>= 8)
+            buf[j] = e & 0xff;
+        put (buf, 8);
+    }
+
+    if (buffer_flush (&bdb) == -1)
+        err (-1, "could not write to file: `%s'", "dnsbl.tmp");
+    if (fsync (fddb) == -1)
+        err (-1, "could not write to file: `%s'", "dnsbl.tmp");
+    if (close (fddb) == -1)
+        err (-1, "could not close file: `%s'", "dnsbl.tmp"); /* NFS stupidity */
+    if (rename ("dnsbl.tmp", "dnsbl.db") == -1)
+        err (-1, "could not move dnsbl.tmp to dnsbl.db");
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * dnsbl.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dns.h"
+#include "byte.h"
+#include "taia.h"
+#include "alloc.h"
+#include "dnsbl.h"
+#include "uint32.h"
+#include "stralloc.h"
+#include "openreadclose.h"
+
+/*
+ * DNS block list: a set of names, each blocked either on its own or along
+ * with every name below it. dnsbl-data(1) compiles the list into the file
+ * dnsbl.db, an open addressing hash table of 64-bit hashes of the names:
+ *
+ *     "ndjbdbl1"  slots (4 bytes)  0 (4 bytes)  slots x entry (8 bytes)
+ *
+ * all numbers little-endian. An entry is the hash of a lower-cased name with
+ * its lowest bit replaced by 1 if the whole subtree is blocked, or 0 for an
+ * empty slot. So a name is looked up with one probe for itself and one for
+ * each of its parents, all in memory.
+ *
+ * The file is read again, and the new table swapped in, when it changes;
+ * that is looked at no more than once every DNSBL_CHECK seconds.
+ */
+
+#define DNSBL_CHECK 5
+
+static uint64 *table;
+static unsigned int slots;          /* power of 2 */
+
+static int loaded;
+static volatile sig_atomic_t reload;
+static struct stat filest;
+static struct taia nextcheck;
+
+/* dnsbl_hash: 64-bit FNV-1a hash of the lower-cased name `dn' */
+uint64
+dnsbl_hash (const char *dn)
+{
+    unsigned char ch = 0;
+    uint64 h = 14695981039346656037ULL;
+    unsigned int len = dns_domain_length (dn);
+
+    while (len--)
+    {
+        ch = *dn++;
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 32;
+        h ^= ch;
+        h *= 1099511628211ULL;
+    }
+    h &= ~(uint64)DNSBL_SUBTREE;
+
+    return h ? h : 2;
+}
+
+/* dnsbl_slot: where to start looking for `key' in a table of `n' slots */
+unsigned int
+dnsbl_slot (uint64 key, unsigned int n)
+{
+    return (key >> 32 ^ key) & (n - 1);
+}
+
+static int
+load (void)
+{
+    uint32 u = 0;
+    uint64 *t = 0;
+    static stralloc sa;
+    unsigned int i = 0, j = 0, empty = 0;
+
+    if (openreadclose (DNSBL_FILE, &sa, 65536) != 1)
+        return -1;
+    if (sa.len < 16 || byte_diff (sa.s, 8, DNSBL_MAGIC))
+        return -1;
+
+    uint32_unpack (sa.s + 8, &u);
+    if (!u || (u & (u - 1)) || (sa.len - 16) / 8 != u || sa.len % 8)
+        return -1;
+    if (!(t = (uint64 *)alloc (u * sizeof (uint64))))
+        return -1;
+
+    for (i = 0, empty = 0; i < u; i++)
+    {
+        t[i] = 0;
+        for (j = 8; j > 0; j--)
+            t[i] = t[i] << 8 | (unsigned char)sa.s[16 + 8 * i + j - 1];
+        empty += !t[i];
+    }
+    /* a lookup stops at an empty slot, a table must have one */
+    if (!empty)
+    {
+        alloc_free (t);
+        return -1;
+    }
+    alloc_free (sa.s);
+    sa.s = 0;
+    sa.a = sa.len = 0;
+
+    if (table)
+        alloc_free (table);
+    table = t;
+    slots = u;
+
+    return 0;
+}
+
+/* dnsbl_reload: read dnsbl.db again before the next name is looked at */
+void
+dnsbl_reload (void)
+{
+    reload = 1;
+}
+
+static void
+check (void)
+{
+    struct stat st;
+    struct taia now;
+
+    taia_now (&now);
+    if (loaded && !reload && taia_less (&now, &nextcheck))
+        return;
+
+    taia_uint (&nextcheck, DNSBL_CHECK);
+    taia_add (&nextcheck, &nextcheck, &now);
+    if (stat (DNSBL_FILE, &st) == -1)
+        return; /* keep what we have */
+    if (loaded && !reload && st.st_mtime == filest.st_mtime
+        && st.st_ino == filest.st_ino && st.st_dev == filest.st_dev)
+        return;
+
+    reload = 0;
+    if (load () == 0)
+    {
+        loaded = 1;
+        filest = st;
+        /* a change later in this same second would go unnoticed */
+        if (st.st_mtime >= time (NULL))
+            filest.st_mtime--;
+    }
+}
+
+/* dnsbl_init: read dnsbl.db; return 0 if there is none to read */
+int
+dnsbl_init (void)
+{
+    check ();
+
+    return loaded;
+}
+
+static uint64
+find (uint64 key)
+{
+    uint64 e = 0;
+    unsigned int n = 0, i = dnsbl_slot (key, slots);
+
+    for (n = 0; n < slots && (e = table[i]); n++)
+    {
+        if ((e & ~(uint64)DNSBL_SUBTREE) == key)
+            return e;
+        i = (i + 1) & (slots - 1);
+    }
+
+    return 0;
+}
+
+/* dnsbl_match: return 1 if the name `dn' is blocked */
+int
+dnsbl_match (const char *dn)
+{
+    check ();
+    if (!slots)
+        return 0;
+
+    if (find (dnsbl_hash (dn)))
+        return 1;
+    while (*dn)
+    {
+        dn += 1 + (unsigned char)*dn;
+        if (*dn && (find (dnsbl_hash (dn)) & DNSBL_SUBTREE))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * dnsbl.h: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#pragma once
+
+#include "uint64.h"
+
+#define DNSBL_FILE "dnsbl.db"
+#define DNSBL_OLDFILE "dnsbl.cdb"  /* the old format, no longer read */
+#define DNSBL_MAGIC "ndjbdbl1"
+#define DNSBL_SUBTREE 1             /* entry blocks names below it too */
+
+extern uint64 dnsbl_hash (const char *);
+
+extern unsigned int dnsbl_slot (uint64, unsigned int);
+
+extern int dnsbl_init (void);
+
+extern void dnsbl_reload (void);
+
+extern int dnsbl_match (const char *);
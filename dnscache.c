@@ -49,7 +49,6 @@ short mode = 0, debug_level = 0;
 static uint16_t server_port = 53;
 static char *cfgfile = CFGFILE, *logfile = LOGFILE, *pidfile = PIDFILE;
 
-#include "cdb.h"
 #include "dns.h"
 #include "env.h"
 #include "ip4.h"
@@ -58,26 +57,33 @@ static char *cfgfile = CFGFILE, *logfile = LOGFILE, *pidfile = PIDFILE;
 #include "scan.h"
 #include "taia.h"
 #include "byte.h"
+#include "case.h"
 #include "open.h"
 #include "query.h"
 #include "alloc.h"
 #include "error.h"
 #include "roots.h"
 #include "cache.h"
+#include "deleg.h"
+#include "dnsbl.h"
+#include "localdata.h"
 #include "ndelay.h"
 #include "strerr.h"
 #include "uint16.h"
+#include "uint32.h"
 #include "uint64.h"
 #include "socket.h"
 #include "common.h"
 #include "clients.h"
 #include "iopause.h"
 #include "response.h"
+#include "zonestat.h"
 #include "okclient.h"
+#include "clientstat.h"
 #include "droproot.h"
 
 static int
-packetquery (char *buf, unsigned int len, char **q,
+packetquery (char *buf, unsigned int len, char q[255],
                         char qtype[2], char qclass[2], char id[2])
 {
     char header[12];
@@ -98,7 +104,7 @@ packetquery (char *buf, unsigned int len, char **q,
     if (byte_diff (header + 4, 2, "\0\1"))
         return 0;
 
-    pos = dns_packet_getname (buf, len, pos, q);
+    pos = dns_packet_copyname (buf, len, pos, q);
     if (!pos)
         return 0;
     pos = dns_packet_copy (buf, len, pos, qtype, 2);
@@ -115,15 +121,75 @@ packetquery (char *buf, unsigned int len, char **q,
     return 1;
 }
 
+/* every response is built here, whether by query.c or localanswer */
+static struct response answer;
+
+/*
+ * With $LOCALDATA set, dnscache answers names in the zones it finds in a
+ * tinydns data.cdb in its working directory by itself, as tinydns would,
+ * without a query going out. Names in zones delegated from there, or not
+ * covered at all, are looked up as usual. The file is opened again every
+ * few seconds, so that it may be replaced while dnscache is running; only
+ * names in a zone with an SOA record there, see localdata.c, are looked for.
+ */
+extern int respond (struct response *, char *, char *, char *); /* tdlookup.c */
+static int localdata = 0;
+
+static int
+localanswer (const char *q, char qtype[2], char qclass[2], char ip[4])
+{
+    static char *dn = NULL;
+
+    if (!localdata || byte_diff (qclass, 2, DNS_C_IN))
+        return 0;
+    if (byte_equal (qtype, 2, DNS_T_AXFR))
+        return 0;
+    if (!dns_domain_copy (&dn, q))
+        return 0;
+    case_lowerb (dn, dns_domain_length (dn));
+    if (!localdata_match (dn))
+        return 0;
+
+    if (!response_query (&answer, q, qtype, qclass))
+        return 0;
+    answer.buf[2] |= 4;
+    if (!respond (&answer, dn, qtype, ip))
+        return 0;
+
+    /* not authoritative: q is in a child zone, ask its servers */
+    return answer.buf[2] & 4;
+}
+
 uint64 numqueries = 0;
+uint64 tfo_accepted = 0; /* TCP clients that sent their query in the SYN */
 static char buf[65535];
-static struct in_addr odst; /* original destination IP */
 static char myipoutgoing[4];
-static char myipincoming[4];
 
-static int udp53 = 0;
+/* dnscache listens on all the addresses in $IP, with one cache for all */
+#define MAXLISTEN 16
+
+static int nlisten = 0;
+static int udp53[MAXLISTEN];
+/*
+ * The question a client asked. A client asking the same question as one
+ * whose query is still in progress, its leader, does not start a query of
+ * its own: it waits as a follower and is sent the leader's response.
+ * Clients are numbered j for u[j] and MAXUDP + j for t[j].
+ */
+struct question
+{
+    char name[255];
+    char type[2];
+    char class[2];
+    uint32 hash;
+    int leader;     /* -1, or the client whose query answers ours */
+    int next;       /* leader: first follower; follower: the next one */
+    int hnext;      /* leader: 1 + next leader in its pending slot, or 0 */
+};
+
 static struct udpclient
 {
+    struct question qn;
     struct query q;
     struct taia start;
     uint64 active; /* query number, if active; otherwise 0 */
@@ -131,10 +197,16 @@ static struct udpclient
     char ip[4];
     uint16 port;
     char id[2];
+    int udp53; /* the socket it came in on */
+    struct in_addr odst; /* original destination IP */
 } u[MAXUDP];
 
 int uactive = 0;
 
+static void q_lead (int);
+static void q_done (int, int);
+static int q_join (int, const char *, const char *, const char *);
+
 void
 u_drop (int j)
 {
@@ -146,6 +218,30 @@ u_drop (int j)
 
     u[j].active = 0;
     --uactive;
+    client_release (u[j].ip);
+    query_drop (&u[j].q);
+    q_done (j, 0);
+}
+
+static void
+u_send (struct udpclient *x)
+{
+    char flags = 0;
+    unsigned int len = 0;
+
+    /* the response may go to TCP followers too; truncate only our copy */
+    len = answer.len;
+    flags = answer.buf[2];
+    response_id (&answer, x->id);
+    if (answer.len > 512)
+        response_tc (&answer);
+    socket_send4 (x->udp53, answer.buf, answer.len, x->ip, x->port, &x->odst);
+
+    if (debug_level)
+        log_querydone (x->active, answer.buf, answer.len);
+
+    answer.len = len;
+    answer.buf[2] = flags;
 }
 
 void
@@ -154,63 +250,169 @@ u_respond (int j)
     if (!u[j].active)
         return;
 
-    response_id (u[j].id);
-    if (response_len > 512)
-        response_tc ();
-    socket_send4 (udp53, response, response_len, u[j].ip, u[j].port, &odst);
-
-    if (debug_level)
-        log_querydone (u[j].active, response, response_len);
-
+    u_send (u + j);
     u[j].active = 0;
     --uactive;
+    client_release (u[j].ip);
+    q_done (j, 1);
 }
 
-void
-u_new (void)
-{
-    int i = 0, j = 0, len = 0;
-    struct udpclient *x = NULL;
+/*
+ * Admission under overload. When every u[] slot is busy, or the event loop
+ * is lagging, a new query is answered from the cache if it can be, without
+ * taking a slot at all. If it can not, and the loop is keeping up, a slot is
+ * freed: the network (/24) holding the most slots gives up its oldest query
+ * that no other client is waiting on. If that is the new client's own
+ * network, the new query is dropped instead, so that one busy network can
+ * not push all the others out. While the loop lags, queries that miss the
+ * cache are dropped. So are those of a client that already has
+ * $CLIENTQUERIES queries in flight, see clientstat.c.
+ */
+#define LAG_MAX 100     /* ms of work per loop iteration, to start shedding */
+#define NETSLOTS 512    /* power of 2, > 2 * MAXUDP */
 
-    static char *q = 0;
-    char qtype[2], qclass[2];
+static struct udpclient spare;
+unsigned int lag = 0;   /* ms, smoothed time spent per loop iteration */
+uint64 shed = 0;        /* queries dropped by admission control */
 
-    for (j = 0; j < MAXUDP; j++)
-        if (!u[j].active)
-            break;
+/*
+ * u_victim: the slot to free for a query from `ip', or -1 to drop it. A
+ * leader that has followers is never chosen: dropping it would drop every
+ * client waiting on its answer, see q_done.
+ */
+static int
+u_victim (const char ip[4])
+{
+    int j = 0, m = -1;
+    uint32 net = 0;
+    unsigned int i = 0;
+    struct { uint32 net; int n; int oldest; } h[NETSLOTS];  /* 1 + slot */
 
-    if (j >= MAXUDP)
+    byte_zero (h, sizeof (h));
+    for (j = 0; j < MAXUDP; j++)
     {
-        j = 0;
-        for (i = 1; i < MAXUDP; i++)
-            if (taia_less (&u[i].start, &u[j].start))
-                j = i;
-        errno = error_timeout;
-        u_drop (j);
+        if (!u[j].active)
+            continue;
+
+        uint32_unpack_big (u[j].ip, &net);
+        net >>= 8;
+        for (i = (net * 2654435761U) >> 23; h[i].n && h[i].net != net;
+                                                i = (i + 1) & (NETSLOTS - 1))
+            ;
+        h[i].net = net;
+        h[i].n++;
+        if (u[j].qn.leader == j && u[j].qn.next >= 0)
+            continue;
+        if (!h[i].oldest || taia_less (&u[j].start, &u[h[i].oldest - 1].start))
+            h[i].oldest = j + 1;
     }
+    for (i = 0; i < NETSLOTS; i++)
+        if (h[i].oldest && (m < 0 || h[i].n > h[m].n))
+            m = i;
+    if (m < 0)
+        return -1;
+
+    uint32_unpack_big (ip, &net);
+    net >>= 8;
+    for (i = (net * 2654435761U) >> 23; h[i].n; i = (i + 1) & (NETSLOTS - 1))
+        if (h[i].net == net)
+            return (h[i].n >= h[m].n) ? -1 : h[m].oldest - 1;
+
+    return h[m].oldest - 1;
+}
 
-    x = u + j;
-    taia_now (&x->start);
+void
+u_new (int s)
+{
+    int j = 0, len = 0, busy = 0;
+    struct udpclient *x = &spare;
+
+    char q[255];
+    char qtype[2], qclass[2];
 
-    len = socket_recv4 (udp53, buf, sizeof (buf), x->ip, &x->port, &odst);
+    taia_now (&x->start);
+    len = socket_recv4 (s, buf, sizeof (buf), x->ip, &x->port, &x->odst);
     if (len == -1)
         return;
+    x->udp53 = s;
     if ((unsigned)len >= sizeof buf)
         return;
     if (x->port < 1024 && x->port != 53)
         return;
     if (!okclient (x->ip))
         return;
-    if (!packetquery (buf, len, &q, qtype, qclass, x->id))
+    if (!packetquery (buf, len, q, qtype, qclass, x->id))
         return;
 
     x->active = ++numqueries;
-    ++uactive;
-
     if (debug_level)
         log_query (x->active, x->ip, x->port, x->id, q, qtype);
+    if (!client_query (x->ip))
+    {
+        errno = error_ratelimit;
+        if (debug_level > 2)
+            log_querydrop (x->active);
+        return;
+    }
+    if (dnsbl_match (q))
+    {
+        errno = error_blockedbydbl;
+        if (debug_level > 2)
+            log_querydrop (x->active);
+        return;
+    }
+    if (localanswer (q, qtype, qclass, x->ip))
+    {
+        u_send (x);
+        return;
+    }
+
+    for (j = 0; j < MAXUDP; j++)
+        if (!u[j].active)
+            break;
+
+    busy = client_busy (x->ip);
+    if (j >= MAXUDP || lag > LAG_MAX || busy)
+    {
+        switch (query_cached (&x->q, &answer, q, qtype, qclass, myipoutgoing))
+        {
+        case 1:
+            u_send (x);
+            return;
+
+        case -1:
+            if (debug_level > 2)
+                log_querydrop (x->active);
+            return;
+        }
+
+        if (busy || lag > LAG_MAX || (j = u_victim (x->ip)) == -1)
+        {
+            shed++;
+            errno = error_busy;
+            if (debug_level > 2)
+                log_querydrop (x->active);
+            return;
+        }
+        errno = error_timeout;
+        u_drop (j);
+    }
+
+    u[j].start = x->start;
+    u[j].active = x->active;
+    byte_copy (u[j].ip, 4, x->ip);
+    u[j].port = x->port;
+    byte_copy (u[j].id, 2, x->id);
+    u[j].udp53 = x->udp53;
+    u[j].odst = x->odst;
+    ++uactive;
+    client_hold (x->ip);
+    x = u + j;
+
+    if (q_join (j, q, qtype, qclass))
+        return;
 
-    switch (query_start (&x->q, q, qtype, qclass, myipoutgoing))
+    switch (query_start (&x->q, &answer, q, qtype, qclass, myipoutgoing))
     {
     case -1:
         u_drop (j);
@@ -218,12 +420,16 @@ u_new (void)
 
     case 1:
         u_respond (j);
+        return;
     }
+    q_lead (j);
 }
 
-static int tcp53 = 0;
+static int tcp53[MAXLISTEN];
+static int fastopen = 0; /* TCP Fast Open queue length, 0 if disabled */
 struct tcpclient
 {
+    struct question qn;
     struct query q;
     struct taia start;
     struct taia timeout;
@@ -285,6 +491,12 @@ t_close (int j)
     close (t[j].tcp);
     t[j].active = 0;
     --tactive;
+    if (t[j].state == 0)
+    {
+        client_release (t[j].ip);
+        query_drop (&t[j].q);
+        q_done (MAXUDP + j, 0);
+    }
 }
 
 void
@@ -304,29 +516,160 @@ t_respond (int j)
         return;
 
     if (debug_level)
-        log_querydone (t[j].active, response, response_len);
+        log_querydone (t[j].active, answer.buf, answer.len);
 
-    response_id (t[j].id);
-    t[j].len = response_len + 2;
+    response_id (&answer, t[j].id);
+    t[j].len = answer.len + 2;
     t_free (j);
-    t[j].buf = alloc (response_len + 2);
+    t[j].buf = alloc (answer.len + 2);
     if (!t[j].buf)
     {
         t_close (j);
         return;
     }
-    uint16_pack_big (t[j].buf, response_len);
-    byte_copy (t[j].buf + 2, response_len, response);
+    uint16_pack_big (t[j].buf, answer.len);
+    byte_copy (t[j].buf + 2, answer.len, answer.buf);
+    client_release (t[j].ip);
     t[j].pos = 0;
     t[j].state = -1;
+    q_done (MAXUDP + j, 1);
+}
+
+
+#define PENDING_SLOTS 256           /* power of 2 */
+
+static int pending[PENDING_SLOTS];  /* 1 + first leader, 0 if none */
+
+static struct question *
+q_get (int c)
+{
+    return (c < MAXUDP) ? &u[c].qn : &t[c - MAXUDP].qn;
+}
+
+static int
+q_follower (int c)
+{
+    struct question *x = q_get (c);
+
+    return x->leader >= 0 && x->leader != c;
+}
+
+/*
+ * q_join: record the question `q' of client `c'. Returns 1 if a query for
+ * the same question is already in progress; `c' then follows its leader.
+ */
+static int
+q_join (int c, const char *q, const char *qtype, const char *qclass)
+{
+    int l = 0;
+    unsigned int len = 0;
+    struct question *x = q_get (c), *y = NULL;
+
+    len = dns_domain_length (q);
+    byte_copy (x->name, len, q);
+    byte_copy (x->type, 2, qtype);
+    byte_copy (x->class, 2, qclass);
+    x->leader = x->next = -1;
+    x->hnext = 0;
+
+    x->hash = dns_domain_hash (q, len, 5381);
+    x->hash = (x->hash * 33) ^ (unsigned char) qtype[1];
+
+    for (l = pending[x->hash & (PENDING_SLOTS - 1)]; l; l = y->hnext)
+    {
+        y = q_get (l - 1);
+        if (y->hash == x->hash && byte_equal (y->type, 2, x->type)
+            && byte_equal (y->class, 2, x->class)
+            && dns_domain_equal (y->name, x->name))
+            break;
+    }
+    if (!l)
+        return 0;
+
+    x->leader = l - 1;
+    x->next = y->next;
+    y->next = c;
+
+    return 1;
+}
+
+/* q_lead: client `c' started a query, others asking the same may follow */
+static void
+q_lead (int c)
+{
+    struct question *x = q_get (c);
+    int *p = pending + (x->hash & (PENDING_SLOTS - 1));
+
+    x->leader = c;
+    x->hnext = *p;
+    *p = c + 1;
+}
+
+/*
+ * q_done: client `c' got its response, if `answered', or was dropped. A
+ * follower leaves its leader; a leader passes the response in `answer' on
+ * to its followers, or drops them.
+ */
+static void
+q_done (int c, int answered)
+{
+    int f = 0, nf = 0, *p = NULL;
+    unsigned int len = 0;
+    struct question *x = q_get (c), *y = NULL;
+
+    if (x->leader < 0)
+        return;
+    if (x->leader != c)
+    {
+        y = q_get (x->leader);
+        while (y->next != c)
+            y = q_get (y->next);
+        y->next = x->next;
+        x->leader = x->next = -1;
+        return;
+    }
+
+    p = pending + (x->hash & (PENDING_SLOTS - 1));
+    while (*p && *p - 1 != c)
+        p = &q_get (*p - 1)->hnext;
+    if (*p)
+        *p = x->hnext;
+    x->hnext = 0;
+
+    len = dns_domain_length (x->name);
+    for (f = x->next; f >= 0; f = nf)
+    {
+        y = q_get (f);
+        nf = y->next;
+        y->leader = y->next = -1;
+
+        /* the follower may have asked in different case */
+        if (answered && answer.len >= 12 + len)
+            byte_copy (answer.buf + 12, len, y->name);
+        if (f < MAXUDP)
+        {
+            if (answered)
+                u_respond (f);
+            else
+                u_drop (f);
+        }
+        else
+        {
+            if (answered)
+                t_respond (f - MAXUDP);
+            else
+                t_drop (f - MAXUDP);
+        }
+    }
+    x->leader = x->next = -1;
 }
 
 void
 t_rw (int j)
 {
-    int r;
+    int r, busy;
     char *ch;
-    static char *q = 0;
+    char q[255];
     unsigned int toread;
     char qtype[2], qclass[2];
     struct tcpclient *x = NULL;
@@ -418,7 +761,7 @@ t_rw (int j)
     if (x->pos < x->len)
         return;
 
-    if (!packetquery (x->buf, x->len, &q, qtype, qclass, x->id))
+    if (!packetquery (x->buf, x->len, q, qtype, qclass, x->id))
     {
         t_close(j);
         return;
@@ -429,7 +772,47 @@ t_rw (int j)
     if (debug_level)
         log_query (x->active, x->ip, x->port, x->id, q, qtype);
 
-    switch (query_start (&x->q, q, qtype, qclass, myipoutgoing))
+    busy = client_busy (x->ip);
+    t_free (j);
+    x->state = 0;
+    client_hold (x->ip);
+    if (!client_query (x->ip))
+    {
+        errno = error_ratelimit;
+        t_drop (j);
+        return;
+    }
+    if (dnsbl_match (q))
+    {
+        errno = error_blockedbydbl;
+        t_drop (j);
+        return;
+    }
+    if (localanswer (q, qtype, qclass, x->ip))
+    {
+        t_respond (j);
+        return;
+    }
+    if (busy)
+    {
+        /* the client has its share of queries in flight: cache only */
+        switch (query_cached (&x->q, &answer, q, qtype, qclass, myipoutgoing))
+        {
+        case 1:
+            t_respond (j);
+            return;
+
+        case 0:
+            shed++;
+            errno = error_busy;
+        }
+        t_drop (j);
+        return;
+    }
+    if (q_join (MAXUDP + j, q, qtype, qclass))
+        return;
+
+    switch (query_start (&x->q, &answer, q, qtype, qclass, myipoutgoing))
     {
     case -1:
         t_drop (j);
@@ -438,12 +821,11 @@ t_rw (int j)
         t_respond (j);
         return;
     }
-    t_free (j);
-    x->state = 0;
+    q_lead (MAXUDP + j);
 }
 
 void
-t_new (void)
+t_new (int s)
 {
     int i = 0, j = 0;
     struct tcpclient *x = NULL;
@@ -452,12 +834,27 @@ t_new (void)
         if (!t[j].active)
           break;
 
+    /*
+     * Free the oldest slot, but not for a query others are waiting on if
+     * there is any other: dropping it would drop them all, see q_done.
+     */
     if (j >= MAXTCP)
     {
-        j = 0;
-        for (i = 1; i < MAXTCP; ++i)
-            if (taia_less (&t[i].start, &t[j].start))
+        j = -1;
+        for (i = 0; i < MAXTCP; ++i)
+        {
+            if (t[i].qn.leader == MAXUDP + i && t[i].qn.next >= 0)
+                continue;
+            if (j < 0 || taia_less (&t[i].start, &t[j].start))
                 j = i;
+        }
+        if (j < 0)
+        {
+            j = 0;
+            for (i = 1; i < MAXTCP; ++i)
+                if (taia_less (&t[i].start, &t[j].start))
+                    j = i;
+        }
         errno = error_timeout;
         if (t[j].state == 0)
           t_drop (j);
@@ -468,7 +865,7 @@ t_new (void)
     x = t + j;
     taia_now (&x->start);
 
-    x->tcp = socket_accept4 (tcp53, x->ip, &x->port);
+    x->tcp = socket_accept4 (s, x->ip, &x->port);
     if (x->tcp == -1)
         return;
     if (x->port < 1024 && x->port != 53)
@@ -486,10 +883,13 @@ t_new (void)
         close(x->tcp);
         return;
     } /* Linux bug */
+    if (fastopen && socket_fastopened (x->tcp))
+        tfo_accepted++;
 
     x->active = 1;
     ++tactive;
     x->state = 1;
+    x->qn.leader = -1;
     t_timeout (j);
 
     if (debug_level > 2)
@@ -499,43 +899,63 @@ t_new (void)
 
 iopause_fd *udp53io = NULL;
 iopause_fd *tcp53io = NULL;
-iopause_fd io[3 + MAXUDP + MAXTCP];
+iopause_fd io[2 * MAXLISTEN + MAXUDP + MAXTCP];
 
 
 static void
 doit (void)
 {
+    struct taia busy;
     struct taia stamp;
+    struct taia woke;
     struct taia deadline;
     int j = 0, r = 0, iolen = 0;
 
+    taia_now (&woke);
     for (;;)
     {
+        /* how long the work after the last iopause took */
         taia_now (&stamp);
+        taia_sub (&busy, &stamp, &woke);
+        lag = (7 * lag + (unsigned int)(taia_approx (&busy) * 1000.0)) / 8;
+
         taia_uint (&deadline, 120);
         taia_add (&deadline, &deadline, &stamp);
+        dns_transmit_reap (&stamp, &deadline);
 
         iolen = 0;
-        udp53io = io + iolen++;
-        udp53io->fd = udp53;
-        udp53io->events = IOPAUSE_READ;
+        udp53io = io + iolen;
+        for (j = 0; j < nlisten; j++)
+        {
+            io[iolen].fd = udp53[j];
+            io[iolen++].events = IOPAUSE_READ;
+        }
 
-        tcp53io = io + iolen++;
-        tcp53io->fd = tcp53;
-        tcp53io->events = IOPAUSE_READ;
+        tcp53io = io + iolen;
+        for (j = 0; j < nlisten; j++)
+        {
+            io[iolen].fd = tcp53[j];
+            io[iolen++].events = IOPAUSE_READ;
+        }
 
         for (j = 0; j < MAXUDP; ++j)
         {
-            if (u[j].active)
+            if (u[j].active && !q_follower (j))
             {
                 u[j].io = io + iolen++;
                 query_io (&u[j].q, u[j].io, &deadline);
             }
         }
 
+        /*
+         * A follower waits with no io entry; it may be answered, and so
+         * need one, before the next pass, see q_done. Mark it to be left
+         * alone until then.
+         */
         for (j = 0; j < MAXTCP; ++j)
         {
-            if (t[j].active)
+            t[j].io = 0;
+            if (t[j].active && !q_follower (MAXUDP + j))
             {
                 t[j].io = io + iolen++;
                 if (t[j].state == 0)
@@ -551,12 +971,13 @@ doit (void)
             }
         }
         iopause (io, iolen, &deadline, &stamp);
+        taia_now (&woke);
 
         for (j = 0; j < MAXUDP; ++j)
         {
-            if (u[j].active)
+            if (u[j].active && !q_follower (j))
             {
-                r = query_get (&u[j].q, u[j].io, &stamp);
+                r = query_get (&u[j].q, u[j].io, &woke);
                 if (r == -1)
                     u_drop (j);
                 if (r == 1)
@@ -565,13 +986,13 @@ doit (void)
         }
         for (j = 0; j < MAXTCP; ++j)
         {
-            if (t[j].active)
+            if (t[j].active && t[j].io && !q_follower (MAXUDP + j))
             {
                 if (t[j].io->revents)
                     t_timeout (j);
                 if (t[j].state == 0)
                 {
-                    r = query_get (&t[j].q, t[j].io, &stamp);
+                    r = query_get (&t[j].q, t[j].io, &woke);
                     if (r == -1)
                         t_drop (j);
                     if (r == 1)
@@ -583,17 +1004,28 @@ doit (void)
             }
         }
 
-        if (udp53io && udp53io->revents)
-                u_new();
+        for (j = 0; j < nlisten; j++)
+            if (udp53io[j].revents)
+                u_new (udp53[j]);
 
-        if (tcp53io && tcp53io->revents)
-                t_new();
+        for (j = 0; j < nlisten; j++)
+            if (tcp53io[j].revents)
+                t_new (tcp53[j]);
     }
 }
 
 
 extern uint32 seed[32];         /* defined in common.c */
 
+static void
+handle_hup (int n)
+{
+    (void) n;
+    okclient_reload ();
+    dnsbl_reload ();
+    localdata_reload ();
+}
+
 void
 usage (void)
 {
@@ -679,20 +1111,6 @@ check_option (int argc, char *argv[])
     return optind;
 }
 
-static int
-dbl_init (void)
-{
-    extern struct cdb bl;    /* dns block list */
-
-    int fd = open_read ("dnsbl.cdb");
-    if (fd == -1)
-        return 0;
-
-    cdb_init (&bl, fd);
-    close (fd);
-
-    return 1;
-}
 
 int
 main (int argc, char *argv[])
@@ -700,13 +1118,19 @@ main (int argc, char *argv[])
     int i = 0;
     time_t t = 0;
     struct sigaction sa;
-    unsigned long cachesize = 0;
-    char *x = NULL, char_seed[128];
+    unsigned int l = 0, n = 0;
+    char *x = NULL, char_seed[128], sources[64];
+    unsigned long cachesize = 0, zonemax = 0, zonenxrate = 0;
+    unsigned long clientrate = 0, clientburst = 0, clientprefix = 32;
+    unsigned long clientmax = 0;
 
     sa.sa_handler = handle_term;
     sigaction (SIGINT, &sa, NULL);
     sigaction (SIGTERM, &sa, NULL);
 
+    sa.sa_handler = handle_hup;
+    sigaction (SIGHUP, &sa, NULL);
+
     sa.sa_handler = SIG_IGN;
     sigaction (SIGPIPE, &sa, NULL);
 
@@ -766,22 +1190,31 @@ main (int argc, char *argv[])
 
     if (!(x = env_get ("IP")))
         err (-1, "$IP not set");
-    if (!ip4_scan (x, myipincoming))
-        err (-1, "could not parse IP address `%s'", x);
-
-    seed_addtime ();
-    udp53 = socket_udp ();
-    if (udp53 == -1)
-        err (-1, "could not open UDP socket");
-    if (socket_bind4_reuse (udp53, myipincoming, server_port) == -1)
-        err (-1, "could not bind UDP socket");
-
-    seed_addtime ();
-    tcp53 = socket_tcp ();
-    if (tcp53 == -1)
-        err (-1, "could not open TCP socket");
-    if (socket_bind4_reuse (tcp53, myipincoming, server_port) == -1)
-        err (-1, "could not bind TCP socket");
+    for (i = 0; x[i]; nlisten++)
+    {
+        char ip[4];
+
+        if (nlisten >= MAXLISTEN)
+            errx (-1, "too many addresses in $IP");
+        if (!(l = ip4_scan (x + i, ip)))
+            errx (-1, "could not parse IP address `%s'", x + i);
+
+        seed_addtime ();
+        udp53[nlisten] = socket_udp ();
+        if (udp53[nlisten] == -1)
+            err (-1, "could not open UDP socket");
+        if (socket_bind4_reuse (udp53[nlisten], ip, server_port) == -1)
+            err (-1, "could not bind UDP socket");
+
+        seed_addtime ();
+        tcp53[nlisten] = socket_tcp ();
+        if (tcp53[nlisten] == -1)
+            err (-1, "could not open TCP socket");
+        if (socket_bind4_reuse (tcp53[nlisten], ip, server_port) == -1)
+            err (-1, "could not bind TCP socket");
+
+        i += (x[i + l] == ',') ? l + 1 : l;
+    }
 
     if (mode & DAEMON)
     {
@@ -798,7 +1231,8 @@ main (int argc, char *argv[])
             err (-1, "could not start a new session for the daemon");
 
     seed_addtime ();
-    socket_tryreservein (udp53, 131072);
+    for (i = 0; i < nlisten; i++)
+        socket_tryreservein (udp53[i], 131072);
 
     memset (char_seed, 0, sizeof (char_seed));
     for (i = 0, x = (char *)seed; (unsigned)i < sizeof (char_seed); i++, x++)
@@ -807,8 +1241,25 @@ main (int argc, char *argv[])
 
     if (!(x = env_get ("IPSEND")))
         err (-1, "$IPSEND not set");
-    if (!ip4_scan (x, myipoutgoing))
-        err (-1, "could not parse IP address `%s'", x);
+    for (i = 0; x[i]; n++)
+    {
+        if (n >= sizeof (sources) / 4 || !(l = ip4_scan (x + i, sources + 4 * n)))
+            errx (-1, "could not parse IP address `%s'", x + i);
+        i += (x[i + l] == ',') ? l + 1 : l;
+    }
+    if (!n || dns_transmit_sources (sources, n) == -1)
+        errx (-1, "could not parse IP address `%s'", x);
+    byte_copy (myipoutgoing, 4, sources);
+
+    if ((x = env_get ("IPSENDPORTS")))
+    {
+        unsigned long lo = 0, hi = 0;
+
+        if (!(l = scan_ulong (x, &lo)) || x[l] != '-'
+            || !(i = scan_ulong (x + l + 1, &hi)) || x[l + 1 + i]
+            || dns_transmit_ports (lo, hi) == -1)
+            errx (-1, "could not parse port range `%s'", x);
+    }
 
     if (!(x = env_get ("CACHESIZE")))
         err (-1, "$CACHESIZE not set");
@@ -818,18 +1269,63 @@ main (int argc, char *argv[])
 
     if (env_get ("HIDETTL"))
         response_hidettl ();
+    if (env_get ("LOCALDATA"))
+    {
+        localdata = 1;
+        if (!localdata_init () && debug_level > 1)
+            warnx ("could not read %s", LOCALDATA_FILE);
+    }
     if (env_get ("FORWARDONLY"))
+    {
         query_forwardonly ();
+        dns_enable_tcppool ();
+    }
     if (env_get ("MERGEQUERIES"))
         dns_enable_merge (log_merge);
+    if ((x = env_get ("TCPFASTOPEN")) && (fastopen = atol (x)) > 0)
+    {
+        for (i = 0; i < nlisten; i++)
+            if (socket_fastopen (tcp53[i], fastopen) == -1 && debug_level > 1)
+                warn ("could not enable TCP Fast Open on listener");
+        dns_enable_fastopen ();
+    }
+    /* every query goes to the same few forwarders, do not cap them */
+    if ((x = env_get ("MAXSERVERQUERIES")) && !env_get ("FORWARDONLY"))
+        dns_infra_maxinflight (atol (x));
+    if ((x = env_get ("MAXZONEQUERIES")))
+        zonemax = atol (x);
+    if ((x = env_get ("ZONENXRATE")))
+        zonenxrate = atol (x);
+    zone_init (zonemax, zonenxrate);
+    if ((x = env_get ("CLIENTRATE")))
+        clientrate = atol (x);
+    if ((x = env_get ("CLIENTBURST")))
+        clientburst = atol (x);
+    if ((x = env_get ("CLIENTPREFIX")) && *x)
+    {
+        if (x[scan_ulong (x, &clientprefix)] || clientprefix > 32)
+            errx (-1, "CLIENTPREFIX `%s' is not a prefix length, 0 to 32", x);
+    }
+    if ((x = env_get ("CLIENTQUERIES")))
+        clientmax = atol (x);
+    client_init (clientrate, clientburst, clientprefix, clientmax);
+    deleg_init ();
     if (!roots_init ())
         err (-1, "could not read servers");
     if (debug_level > 3)
         roots_display();
-    if (socket_listen (tcp53, 20) == -1)
-        err (-1, "could not listen on TCP socket");
-    if (!dbl_init() && debug_level > 1)
-        warnx ("could not read dnsbl.cdb");
+    for (i = 0; i < nlisten; i++)
+        if (socket_listen (tcp53[i], 20) == -1)
+            err (-1, "could not listen on TCP socket");
+    if (!dnsbl_init ())
+    {
+        /* do not let an upgrade quietly stop blocking names */
+        if (access (DNSBL_OLDFILE, F_OK) == 0)
+            warnx ("%s is no longer read, names are NOT blocked: "
+                   "run dnsbl-data to create %s", DNSBL_OLDFILE, DNSBL_FILE);
+        else if (debug_level > 1)
+            warnx ("could not read %s", DNSBL_FILE);
+    }
 
     doit ();
 
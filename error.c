@@ -123,3 +123,9 @@ ECONNREFUSED;
 #endif
 
 int error_blockedbydbl = -18;
+
+int error_busy = -19;
+
+int error_flood = -20;
+
+int error_ratelimit = -21;
@@ -46,6 +46,9 @@ extern int error_inprogress;
 extern int error_wouldblock;
 extern int error_connrefused;
 extern int error_blockedbydbl;
+extern int error_busy;
+extern int error_flood;
+extern int error_ratelimit;
 
 extern int error_temp (int);
 
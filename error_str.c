@@ -47,6 +47,9 @@ error_str (int i)
     X (error_isdir, "is a directory")
     X (error_connrefused, "connection refused")
     X (error_blockedbydbl, "blocked by dns block list")
+    X (error_busy, "too many queries in flight")
+    X (error_flood, "zone flooded with nonexistent names")
+    X (error_ratelimit, "over the rate limit")
 
 #ifdef ESRCH
     X (ESRCH, "no such process")
@@ -0,0 +1,288 @@
+/*
+ * localdata.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dns.h"
+#include "byte.h"
+#include "open.h"
+#include "taia.h"
+#include "alloc.h"
+#include "buffer.h"
+#include "uint32.h"
+#include "localdata.h"
+
+/*
+ * Local zones: the zones dnscache answers from a tinydns data.cdb by itself,
+ * see LOCALDATA in dnscache.c. They are the owners of the SOA records in the
+ * file, kept as an open addressing hash table of their name hashes, so that
+ * the many names in none of them are told apart in memory, without running
+ * tdlookup for each. Two names may hash alike; that only costs tdlookup a
+ * look at the file.
+ *
+ * The file is read again when it changes; that is looked at no more than
+ * once every LOCALDATA_CHECK seconds.
+ */
+
+#define LOCALDATA_CHECK 5
+
+static uint32 *table;
+static unsigned int slots;          /* power of 2 */
+static unsigned int used;
+
+static int loaded;
+static volatile sig_atomic_t reload;
+static struct stat filest;
+static struct taia nextcheck;
+
+static uint32
+hash (const char *dn, unsigned int len)
+{
+    uint32 h = dns_domain_hash (dn, len, 5381);
+
+    return h ? h : 1;
+}
+
+static void
+insert (uint32 *t, unsigned int n, uint32 key)
+{
+    unsigned int i = key & (n - 1);
+
+    for (; t[i]; i = (i + 1) & (n - 1))
+        if (t[i] == key)
+            return;
+    t[i] = key;
+    used++;
+}
+
+static int
+add (uint32 **t, unsigned int *n, uint32 key)
+{
+    uint32 *x = 0;
+    unsigned int i = 0, m = 0;
+
+    /* keep the table at most half full */
+    if (2 * (used + 1) > *n)
+    {
+        m = *n ? 2 * *n : 64;
+        if (!(x = (uint32 *)alloc (m * sizeof (uint32))))
+            return -1;
+        byte_zero (x, m * sizeof (uint32));
+
+        used = 0;
+        for (i = 0; i < *n; i++)
+            if ((*t)[i])
+                insert (x, m, (*t)[i]);
+        if (*t)
+            alloc_free (*t);
+        *t = x;
+        *n = m;
+    }
+    insert (*t, *n, key);
+
+    return 0;
+}
+
+static int
+get (buffer *b, char *buf, unsigned int len)
+{
+    int r = 0;
+
+    while (len)
+    {
+        if ((r = buffer_get (b, buf, len)) <= 0)
+            return -1;
+        buf += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+static int
+skip (buffer *b, uint32 len)
+{
+    char x[512];
+    unsigned int n = 0;
+
+    while (len)
+    {
+        n = len < sizeof (x) ? len : sizeof (x);
+        if (get (b, x, n) == -1)
+            return -1;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * load: walk the records of data.cdb, which run from the end of its 2048
+ * byte header to the position of its first hash table, each as
+ *
+ *     key length (4 bytes)  data length (4 bytes)  key  data
+ *
+ * and gather the owners of the SOA records into a new table.
+ */
+static int
+load (void)
+{
+    buffer b;
+    char bspace[8192], head[2048], key[255], type[2];
+    int fd = -1, r = -1;
+    uint32 *t = 0, pos = 0, end = 0, klen = 0, dlen = 0;
+    unsigned int n = 0;
+
+    if ((fd = open_read (LOCALDATA_FILE)) == -1)
+        return -1;
+    buffer_init (&b, buffer_unixread, fd, bspace, sizeof (bspace));
+    if (get (&b, head, sizeof (head)) == -1)
+        goto done;
+
+    used = 0;
+    uint32_unpack (head, &end);
+    for (pos = sizeof (head); pos < end; pos += 8 + klen + dlen)
+    {
+        if (get (&b, head, 8) == -1)
+            goto done;
+        uint32_unpack (head, &klen);
+        uint32_unpack (head + 4, &dlen);
+        if (klen > sizeof (key) || dlen < 2)
+        {
+            /* not a name, e.g. a longer location key */
+            if (skip (&b, klen) == -1 || skip (&b, dlen) == -1)
+                goto done;
+            continue;
+        }
+        if (get (&b, key, klen) == -1 || get (&b, type, 2) == -1
+            || skip (&b, dlen - 2) == -1)
+            goto done;
+
+        /* location keys, "\0%" and an address prefix, are no names */
+        if (byte_equal (type, 2, DNS_T_SOA) && klen
+            && dns_domain_length (key) == klen)
+            if (add (&t, &n, hash (key, klen)) == -1)
+                goto done;
+    }
+    r = 0;
+
+done:
+    close (fd);
+    if (r == -1)
+    {
+        if (t)
+            alloc_free (t);
+        return -1;
+    }
+
+    if (table)
+        alloc_free (table);
+    table = t;
+    slots = n;
+
+    return 0;
+}
+
+/* localdata_reload: read data.cdb again before the next name is looked at */
+void
+localdata_reload (void)
+{
+    reload = 1;
+}
+
+static void
+check (void)
+{
+    struct stat st;
+    struct taia now;
+
+    taia_now (&now);
+    if (loaded && !reload && taia_less (&now, &nextcheck))
+        return;
+
+    taia_uint (&nextcheck, LOCALDATA_CHECK);
+    taia_add (&nextcheck, &nextcheck, &now);
+    if (stat (LOCALDATA_FILE, &st) == -1)
+        return; /* keep what we have */
+    if (loaded && !reload && st.st_mtime == filest.st_mtime
+        && st.st_ino == filest.st_ino && st.st_dev == filest.st_dev)
+        return;
+
+    reload = 0;
+    if (load () == 0)
+    {
+        loaded = 1;
+        filest = st;
+        /* a change later in this same second would go unnoticed */
+        if (st.st_mtime >= time (NULL))
+            filest.st_mtime--;
+    }
+}
+
+/* localdata_init: read data.cdb; return 0 if there is none to read */
+int
+localdata_init (void)
+{
+    check ();
+
+    return loaded;
+}
+
+static int
+find (uint32 key)
+{
+    uint32 e = 0;
+    unsigned int n = 0, i = key & (slots - 1);
+
+    for (n = 0; n < slots && (e = table[i]); n++)
+    {
+        if (e == key)
+            return 1;
+        i = (i + 1) & (slots - 1);
+    }
+
+    return 0;
+}
+
+/* localdata_match: return 1 if the name `dn' may be in a local zone */
+int
+localdata_match (const char *dn)
+{
+    unsigned int len = 0;
+
+    check ();
+    if (!slots)
+        return 0;
+
+    len = dns_domain_length (dn);
+    for (;;)
+    {
+        if (find (hash (dn, len)))
+            return 1;
+        if (!*dn)
+            return 0;
+        len -= 1 + (unsigned char)*dn;
+        dn += 1 + (unsigned char)*dn;
+    }
+}
@@ -355,6 +355,25 @@ log_cachedns (const char *control, const char *ns)
     line();
 }
 
+void
+log_cacheddeleg (const char *control, const char servers[64])
+{
+    int i = 0;
+
+    string ("     cc deleg ");
+    name (control);
+    for (i = 0; i < 64; i += 4)
+    {
+        if (byte_diff (servers + i, 4, "\0\0\0\0"))
+        {
+            space ();
+            ip (servers + i);
+        }
+    }
+
+    line ();
+}
+
 void
 log_cachednxdomain (const char *dn)
 {
@@ -364,6 +383,17 @@ log_cachednxdomain (const char *dn)
     line ();
 }
 
+void
+log_cachedlame (const char server[4], const char *control)
+{
+    string ("     cc lame ");
+    ip (server);
+    space ();
+    name (control);
+
+    line ();
+}
+
 void
 log_nxdomain (const char server[4], const char *q, unsigned int ttl)
 {
@@ -550,7 +580,19 @@ log_rrsoa (const char server[4], const char *q, const char *n1,
 }
 
 void
-log_stats (int uactive, int tactive, uint64 numqueries, uint64 cache_motion)
+log_rrlstats (uint64 limited, uint64 slipped)
+{
+    string ("   = rrl dropped ");
+    number (limited);
+    string (" slipped ");
+    number (slipped);
+
+    line ();
+}
+
+void
+log_stats (int uactive, int tactive, uint64 numqueries, uint64 cache_motion,
+                                                    const struct stats *s)
 {
 
     string ("   = ss Q");
@@ -561,6 +603,27 @@ log_stats (int uactive, int tactive, uint64 numqueries, uint64 cache_motion)
     number (uactive);
     string (" Qtcp ");
     number (tactive);
+    string (" Scap ");
+    number (s->servercapped);
+    string (" Zcap ");
+    number (s->zonecapped);
+    string (" Zflood ");
+    number (s->zoneflooded);
+    string (" Tfo ");
+    number (s->tfoaccepted);
+    string ("/");
+    number (s->tfook);
+    string ("/");
+    number (s->tfofail);
+    string (" Shed ");
+    number (s->shed);
+    string (" Lag ");
+    number (s->lag);
+    string ("ms");
+    string (" Crate ");
+    number (s->clientlimited);
+    string (" Ccap ");
+    number (s->clientcapped);
 
     line ();
 }
@@ -45,6 +45,10 @@ extern void log_cachednxdomain(const char *);
 
 extern void log_cachedns(const char *, const char *);
 
+extern void log_cachedlame(const char *, const char *);
+
+extern void log_cacheddeleg(const char *, const char *);
+
 extern void log_tx(const char *, const char *,
                     const char *, const char *, unsigned int);
 
@@ -73,4 +77,21 @@ extern void log_rrmx(const char *, const char *,
 extern void log_rrsoa(const char *, const char *, const char *,
                         const char *, const char *, unsigned int);
 
-extern void log_stats(int, int, uint64, uint64);
+extern void log_rrlstats(uint64, uint64);
+
+/* what dnscache turned away or did differently, for log_stats */
+struct stats
+{
+    uint64 servercapped;            /* over MAXSERVERQUERIES */
+    uint64 zonecapped;              /* over MAXZONEQUERIES */
+    uint64 zoneflooded;             /* in a zone over ZONENXRATE */
+    uint64 tfoaccepted;             /* TCP Fast Open from clients */
+    uint64 tfook;                   /* and to servers, accepted or not */
+    uint64 tfofail;
+    uint64 shed;                    /* by admission control */
+    uint64 clientlimited;           /* over CLIENTRATE */
+    uint64 clientcapped;            /* over CLIENTQUERIES */
+    unsigned int lag;               /* ms per loop iteration */
+};
+
+extern void log_stats(int, int, uint64, uint64, const struct stats *);
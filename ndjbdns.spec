@@ -202,6 +202,7 @@ fi
 %{_bindir}/dnsip
 %{_bindir}/dnsipq
 %{_bindir}/dnsname
+%{_bindir}/dnsbl-data
 %{_bindir}/dnsq
 %{_bindir}/dnsqr
 %{_bindir}/dnstrace
@@ -245,6 +246,7 @@ fi
 %{_mandir}/man1/dnsip.1.gz
 %{_mandir}/man1/dnsipq.1.gz
 %{_mandir}/man1/dnsname.1.gz
+%{_mandir}/man1/dnsbl-data.1.gz
 %{_mandir}/man1/dnsq.1.gz
 %{_mandir}/man1/dnsqr.1.gz
 %{_mandir}/man1/dnstrace.1.gz
@@ -3,7 +3,7 @@
  * by Dr. D J Bernstein and later released under public-domain since late
  * December 2007 (http://cr.yp.to/distributors.html).
  *
- * Copyright (C) 2009 - 2012 Prasad J Pandit
+ * Copyright (C) 2009 - 2015 Prasad J Pandit
  *
  * This program is a free software; you can redistribute it and/or modify
  * it under the terms of GNU General Public License as published by Free
@@ -20,36 +20,193 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include "str.h"
-#include "ip4.h"
+#include "byte.h"
+#include "taia.h"
+#include "alloc.h"
 #include "okclient.h"
 
-static char fn[3 + IP4_FMT];        /* ip4.h: IP4_FMT = 20 */
+/*
+ * Clients are allowed by the files in ip/: ip/1.2.3.4 allows the client
+ * 1.2.3.4, ip/1.2.3 allows every client in 1.2.3.*, and so on. The names
+ * are read once into a trie with one level per octet, so that okclient()
+ * is a handful of memory lookups instead of up to four stat() calls.
+ *
+ * The directory is read again after a SIGHUP, see okclient_reload(), and
+ * when its modification time changes; that is looked at no more than once
+ * every OKCLIENT_CHECK seconds.
+ */
+
+#define OKCLIENT_CHECK 5
+
+struct node
+{
+    unsigned int child[256];        /* index of the next node, 0 if none */
+    int ok;                         /* clients under this prefix allowed */
+};
+
+static struct node *trie;
+static unsigned int trielen;
+static unsigned int triesize;
+
+static int loaded;
+static volatile sig_atomic_t reload;
+static struct stat dirst;
+static struct taia nextcheck;
+
+static int
+trie_new (struct node **t, unsigned int *len, unsigned int *size)
+{
+    unsigned int n = 0;
+
+    if (*len >= *size)
+    {
+        n = *size ? 2 * *size : 64;
+        if (!alloc_re ((char **)t, *size * sizeof (struct node),
+                                   n * sizeof (struct node)))
+            return -1;
+        *size = n;
+    }
+    byte_zero (*t + *len, sizeof (struct node));
+
+    return (*len)++;
+}
+
+/* prefix: parse a name like 1.2.3 into its octets; return how many */
+static int
+prefix (const char *s, unsigned char ip[4])
+{
+    int n = 0;
+    unsigned int u = 0, digits = 0;
+
+    for (;; s++)
+    {
+        if (*s >= '0' && *s <= '9')
+        {
+            /* as ip4_fmt writes them: no leading zeros */
+            if (digits && !u)
+                return 0;
+            u = 10 * u + (*s - '0');
+            if (++digits > 3 || u > 255)
+                return 0;
+            continue;
+        }
+        if (!digits || n >= 4 || (*s && *s != '.'))
+            return 0;
+        ip[n++] = u;
+        if (!*s)
+            return n;
+        u = digits = 0;
+    }
+}
+
+static int
+load (void)
+{
+    DIR *dir = NULL;
+    struct dirent *d = NULL;
+    unsigned char ip[4];
+    struct node *t = 0;
+    unsigned int len = 0, size = 0, i = 0, j = 0;
+    int n = 0, k = 0;
+
+    if (!(dir = opendir ("ip")))
+        return -1;
+    if (trie_new (&t, &len, &size) == -1)
+        goto FAIL;
+
+    while ((d = readdir (dir)))
+    {
+        if (!(n = prefix (d->d_name, ip)))
+            continue;
+
+        for (i = j = 0; (int)i < n; i++)
+        {
+            if (!t[j].child[ip[i]])
+            {
+                if ((k = trie_new (&t, &len, &size)) == -1)
+                    goto FAIL;
+                t[j].child[ip[i]] = k;
+            }
+            j = t[j].child[ip[i]];
+        }
+        t[j].ok = 1;
+    }
+    closedir (dir);
+
+    if (trie)
+        alloc_free (trie);
+    trie = t;
+    trielen = len;
+    triesize = size;
+
+    return 0;
+
+FAIL:
+    closedir (dir);
+    if (t)
+        alloc_free (t);
+    return -1;
+}
+
+/* okclient_reload: read ip/ again before the next client is looked at */
+void
+okclient_reload (void)
+{
+    reload = 1;
+}
+
+static void
+check (void)
+{
+    struct stat st;
+    struct taia now;
+
+    taia_now (&now);
+    if (loaded && !reload && taia_less (&now, &nextcheck))
+        return;
+
+    taia_uint (&nextcheck, OKCLIENT_CHECK);
+    taia_add (&nextcheck, &nextcheck, &now);
+    if (stat ("ip", &st) == -1)
+        return; /* keep what we have */
+    if (loaded && !reload && st.st_mtime == dirst.st_mtime
+        && st.st_ino == dirst.st_ino && st.st_dev == dirst.st_dev)
+        return;
+
+    reload = 0;
+    if (load () == 0)
+    {
+        loaded = 1;
+        dirst = st;
+        /* a change later in this same second would go unnoticed */
+        if (st.st_mtime >= time (NULL))
+            dirst.st_mtime--;
+    }
+}
 
 int
 okclient (char ip[4])
 {
     int i = 0;
-    struct stat st;
+    unsigned int j = 0;
 
-    fn[0] = 'i';
-    fn[1] = 'p';
-    fn[2] = '/';
-    fn[3 + ip4_fmt (fn + 3, ip)] = 0;
+    check ();
+    if (!trielen)
+        return 0;
 
-    for (;;)
+    for (i = 0; i < 4; i++)
     {
-        if (stat (fn, &st) == 0)
+        if (trie[j].ok)
             return 1;
-
-        /* treat temporary error as rejection */
-        i = str_rchr (fn, '.');
-        if (!fn[i])
+        if (!(j = trie[j].child[(unsigned char)ip[i]]))
             return 0;
-
-        fn[i] = 0;
     }
+
+    return trie[j].ok;
 }
@@ -1,3 +1,5 @@
 #pragma once
 
 extern int okclient(char *);
+
+extern void okclient_reload(void);
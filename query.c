@@ -21,12 +21,13 @@
  */
 
 #include "dd.h"
-#include "cdb.h"
 #include "dns.h"
 #include "log.h"
 #include "byte.h"
 #include "case.h"
 #include "cache.h"
+#include "deleg.h"
+#include "dnsbl.h"
 #include "alloc.h"
 #include "query.h"
 #include "error.h"
@@ -35,11 +36,13 @@
 #include "uint32.h"
 #include "uint16.h"
 #include "response.h"
+#include "zonestat.h"
+#include "clientstat.h"
 
 extern short debug_level;
 static int flagforwardonly = 0;
-
-struct cdb bl;      /* dns block list */
+static int flagcacheonly = 0;       /* see query_cached() */
+static int missedcache = 0;
 
 void
 query_forwardonly (void)
@@ -65,6 +68,127 @@ cachegeneric (const char type[2], const char *d,
     cache_set (key, len + 2, data, datalen, ttl);
 }
 
+/*
+ * Lame servers are remembered in the cache under the key "\0\0" + zone +
+ * IP address, with no data. No record type is 0 and no other key has any
+ * bytes following the name, so these never collide with cachegeneric().
+ */
+#define LAME_TTL 600
+
+static void
+lame_set (const char *control, const char ip[4])
+{
+    char key[261];
+    unsigned int len = 0;
+
+    len = dns_domain_length (control);
+    if (len > 255)
+        return;
+
+    byte_copy (key, 2, "\0\0");
+    byte_copy (key + 2, len, control);
+    case_lowerb (key + 2, len);
+    byte_copy (key + 2 + len, 4, ip);
+
+    cache_set (key, len + 6, "", 0, LAME_TTL);
+}
+
+static int
+lame_get (const char *control, const char ip[4])
+{
+    uint32 ttl = 0;
+    char key[261];
+    unsigned int len = 0, datalen = 0;
+
+    len = dns_domain_length (control);
+    if (len > 255)
+        return 0;
+
+    byte_copy (key, 2, "\0\0");
+    byte_copy (key + 2, len, control);
+    case_lowerb (key + 2, len);
+    byte_copy (key + 2 + len, 4, ip);
+
+    return cache_get (key, len + 6, &datalen, &ttl) != 0;
+}
+
+
+/*
+ * nscached: if the addresses of name server `ns' are in the cache, add
+ * them to `servers', lower `*serversttl' to their TTL if that is less, and
+ * return 1. Otherwise return 0.
+ */
+static int
+nscached (char servers[64], uint32 *serversttl, const char *ns)
+{
+    char key[257];
+    uint32 ttl = 0;
+    char *cached = 0;
+    unsigned int j = 0, len = 0, cachedlen = 0;
+
+    len = dns_domain_length (ns);
+    if (len > 255)
+        return 0;
+
+    byte_copy (key, 2, DNS_T_A);
+    byte_copy (key + 2, len, ns);
+    case_lowerb (key + 2, len);
+    if (!(cached = cache_get (key, len + 2, &cachedlen, &ttl)))
+        return 0;
+
+    if (debug_level > 2)
+        log_cachedanswer (ns, DNS_T_A);
+    if (ttl < *serversttl)
+        *serversttl = ttl;
+    for (; cachedlen >= 4; cached += 4, cachedlen -= 4)
+    {
+        for (j = 0; j < 64; j += 4)
+        {
+            if (byte_equal (servers + j, 4, "\0\0\0\0"))
+            {
+                byte_copy (servers + j, 4, cached);
+                break;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * nxcut: look for an ancestor of `d' that is cached as nonexistent. If
+ * there is one, nothing below it exists either (RFC 8020). Returns that
+ * ancestor, or 0. At most QUERY_MAXNXCUT probes are made per query.
+ */
+static const char *
+nxcut (struct query *z, const char *d)
+{
+    char key[257];
+    uint32 ttl = 0;
+    unsigned int len = 0, cachedlen = 0;
+
+    len = dns_domain_length (d);
+    if (len > 255)
+        return 0;
+
+    byte_copy (key + 2, len, d);
+    case_lowerb (key + 2, len);
+    d = key + 2;
+    while (*d && z->nxcut < QUERY_MAXNXCUT)
+    {
+        d += 1 + (unsigned char) *d;
+        if (!*d)
+            break;
+
+        byte_copy ((char *)d - 2, 2, DNS_T_ANY);
+        ++z->nxcut;
+        if (cache_get (d - 2, len - (d - (key + 2)) + 2, &cachedlen, &ttl))
+            return d;
+    }
+
+    return 0;
+}
+
 
 static char save_buf[8192];
 static unsigned int save_ok;
@@ -120,11 +244,58 @@ ttlget (char buf[4])
 }
 
 
+static void
+zonefree (struct query *z)
+{
+    if (!z->zone)
+        return;
+    zone_release (z->zone);
+    z->zone = 0;
+}
+
+/*
+ * zonehold: count the query about to go out to the servers of `control'.
+ * The root zone is not counted, nor is anything when forwarding: all
+ * queries would go to the same `zone', and the same few servers.
+ *
+ * Names that a client asked for are not looked up in a zone that has been
+ * answering NXDOMAIN at a flood rate, see zone_flood(). Name server
+ * addresses still are, lest the zone's own delegations stop resolving.
+ * Top level zones are never taken to be flooded: a busy cache sees many
+ * NXDOMAIN answers from them all the time, and refusing every uncached
+ * name below `com' would hurt far more than the flood.
+ */
+static int
+zonehold (struct query *z, const char *control)
+{
+    uint64 id = 0;
+
+    zonefree (z);
+    if (flagforwardonly || !*control)
+        return 1;
+
+    id = zone_id (control);
+    if (!z->level && control[1 + (unsigned char)*control] && zone_flood (id))
+    {
+        errno = error_flood;
+        return 0;
+    }
+    if (!zone_hold (id))
+    {
+        errno = error_busy;
+        return 0;
+    }
+    z->zone = id;
+
+    return 1;
+}
+
 static void
 cleanup (struct query *z)
 {
     int j = 0, k = 0;
 
+    zonefree (z);
     dns_transmit_free (&z->dt);
     for (j = 0; j < QUERY_MAXALIAS; ++j)
         dns_domain_free (&z->alias[j]);
@@ -137,6 +308,16 @@ cleanup (struct query *z)
     }
 }
 
+/*
+ * query_drop: give up on query `z', whose client is gone, at once rather
+ * than when its slot is next used: the servers and zone it was counted
+ * against, see zonehold(), are released now.
+ */
+void
+query_drop (struct query *z)
+{
+    cleanup (z);
+}
 
 static int
 rqa (struct query *z)
@@ -147,23 +328,23 @@ rqa (struct query *z)
     {
         if (z->alias[i])
         {
-            if (!response_query (z->alias[i], z->type, z->class))
+            if (!response_query (z->r, z->alias[i], z->type, z->class))
                 return 0;
             while (i > 0)
             {
-                if (!response_cname (z->alias[i],
+                if (!response_cname (z->r, z->alias[i],
                                      z->alias[i - 1], z->aliasttl[i]))
                     return 0;
                 --i;
             }
-            if (!response_cname (z->alias[0], z->name[0], z->aliasttl[0]))
+            if (!response_cname (z->r, z->alias[0], z->name[0], z->aliasttl[0]))
                 return 0;
 
             return 1;
         }
     }
 
-    if (!response_query (z->name[0], z->type, z->class))
+    if (!response_query (z->r, z->name[0], z->type, z->class))
         return 0;
 
     return 1;
@@ -183,57 +364,137 @@ globalip (char *d, char ip[4])
     return 0;
 }
 
-static char *t1 = 0;
-static char *t2 = 0;
-static char *t3 = 0;
+static char t1[255];
+static char t2[255];
+static char t3[255];
 static char *cname = 0;
 static char *referral = 0;
-static unsigned int *records = 0;
 
+/*
+ * The records of a response, each parsed once: sorting them, and grouping
+ * them by owner and type to be cached, then decodes no names again. Owners
+ * are compared by a hash first, and only if that is equal in the packet
+ * itself, where those of the same name usually point to the same place.
+ */
+struct rr
+{
+    unsigned int pos;       /* of the owner name */
+    unsigned int data;      /* of the rdata */
+    uint32 hash;            /* of the lower-cased owner name */
+    uint32 ttl;
+    uint16 datalen;
+    char type[2];
+    char class[2];
+};
+
+static struct rr *records = 0;
+
+/* namecmp: compare the names at pos1 and pos2 of `buf', ignoring case */
 static int
-smaller (char *buf, unsigned int len, unsigned int pos1, unsigned int pos2)
+namecmp (const char *buf, unsigned int len,
+                        unsigned int pos1, unsigned int pos2)
 {
-    int r = 0;
-    char header1[12], header2[12];
-    unsigned int len1 = 0, len2 = 0;
+    char c1 = 0, c2 = 0;
+    unsigned int i = 0, n = 0, loop = 0;
 
-    pos1 = dns_packet_getname (buf, len, pos1, &t1);
-    dns_packet_copy (buf, len, pos1, header1, 10);
-    pos2 = dns_packet_getname (buf, len, pos2, &t2);
-    dns_packet_copy (buf, len, pos2, header2, 10);
+    for (;;)
+    {
+        while (pos1 + 1 < len && (unsigned char)buf[pos1] >= 192)
+            pos1 = ((buf[pos1] & 63) << 8) + (unsigned char)buf[pos1 + 1];
+        while (pos2 + 1 < len && (unsigned char)buf[pos2] >= 192)
+            pos2 = ((buf[pos2] & 63) << 8) + (unsigned char)buf[pos2 + 1];
+        if (pos1 == pos2)
+            return 0;
+        if (pos1 >= len || pos2 >= len || ++loop > 128)
+            return (pos1 < pos2) ? -1 : 1;
+
+        n = (unsigned char)buf[pos1];
+        if (n != (unsigned char)buf[pos2])
+            return (n < (unsigned char)buf[pos2]) ? -1 : 1;
+        if (!n)
+            return 0;
+        if (n >= len - pos1 || n >= len - pos2)
+            return (pos1 < pos2) ? -1 : 1;
+
+        for (i = 1; i <= n; i++)
+        {
+            c1 = buf[pos1 + i];
+            c2 = buf[pos2 + i];
+            if (c1 >= 'A' && c1 <= 'Z')
+                c1 += 32;
+            if (c2 >= 'A' && c2 <= 'Z')
+                c2 += 32;
+            if (c1 != c2)
+                return ((unsigned char)c1 < (unsigned char)c2) ? -1 : 1;
+        }
+        pos1 += 1 + n;
+        pos2 += 1 + n;
+    }
+}
 
-    r = byte_diff (header1, 4, header2);
-    if (r < 0)
-        return 1;
-    if (r > 0)
-        return 0;
+/* same: return 1 if records `a' and `b' have the same owner, type and class */
+static int
+same (const char *buf, unsigned int len, const struct rr *a, const struct rr *b)
+{
+    return a->hash == b->hash && byte_equal (a->type, 2, b->type)
+        && byte_equal (a->class, 2, b->class)
+        && !namecmp (buf, len, a->pos, b->pos);
+}
 
-    len1 = dns_domain_length (t1);
-    len2 = dns_domain_length (t2);
-    if (len1 < len2)
-        return 1;
-    if (len1 > len2)
-        return 0;
+static int
+smaller (const char *buf, unsigned int len,
+                        const struct rr *a, const struct rr *b)
+{
+    int r = 0;
 
-    r = case_diffb (t1, len1, t2);
-    if (r < 0)
-        return 1;
-    if (r > 0)
-        return 0;
+    r = byte_diff (a->type, 2, b->type);
+    if (!r)
+        r = byte_diff (a->class, 2, b->class);
+    if (r)
+        return r < 0;
+    if (a->hash != b->hash)
+        return a->hash < b->hash;
 
-    if (pos1 < pos2)
-        return 1;
+    r = namecmp (buf, len, a->pos, b->pos);
+    if (r)
+        return r < 0;
 
-    return 0;
+    return a->pos < b->pos;
+}
+
+static void
+stats (void)
+{
+    struct stats s;
+
+    extern int uactive;
+    extern int tactive;
+    extern uint64 numqueries;
+    extern uint64 tfo_accepted;
+    extern uint64 shed;
+    extern unsigned int lag;
+
+    s.servercapped = dns_infra_capped;
+    s.zonecapped = zone_capped;
+    s.zoneflooded = zone_flooded;
+    s.tfoaccepted = tfo_accepted;
+    s.tfook = dns_tfo_ok;
+    s.tfofail = dns_tfo_fail;
+    s.shed = shed;
+    s.clientlimited = client_limited;
+    s.clientcapped = client_capped;
+    s.lag = lag;
+
+    log_stats (uactive, tactive, numqueries, cache_motion, &s);
 }
 
 static int
 doit (struct query *z, int state)
 {
     char key[257];
-    char misc[20], header[12];
+    char misc[20], header[12], cutservers[64];
     char *buf = 0, *cached = 0;
-    const char *whichserver = 0;
+    const char *whichserver = 0, *cut = 0;
 
     unsigned int rcode = 0;
     unsigned int posanswers = 0;
@@ -252,17 +513,12 @@ doit (struct query *z, int state)
     const char *dtype = 0;
     unsigned int dlen = 0;
 
-    int flagout = 0, flagcname = 0;
+    int flagout = 0, flagcname = 0, flagcut = 0;
     int flagreferral = 0, flagsoa = 0;
 
     int i = 0, j = 0, k = 0, p = 0, q = 0;
     uint32 ttl = 0, soattl = 0, cnamettl = 0;
 
-    extern int uactive;
-    extern int tactive;
-    extern uint64 numqueries;
-    extern uint64 cache_motion;
-
     errno = error_io;
     if (state == 1)
         goto HAVEPACKET;
@@ -270,7 +526,16 @@ doit (struct query *z, int state)
     {
         if (debug_level > 1)
             log_servfail (z->name[z->level]);
-        goto SERVFAIL;
+
+        /* every server failed; look up the name servers not yet tried */
+        for (j = 0; j < QUERY_MAXNS; ++j)
+            if (z->ns[z->level][j])
+                break;
+        if (j == QUERY_MAXNS)
+            goto SERVFAIL;
+
+        byte_zero (z->servers[z->level], 64);
+        goto HAVENS;
     }
 
 
@@ -299,11 +564,11 @@ NEWNAME:
             goto DIE;
         if (typematch (DNS_T_A, dtype))
         {
-            if (!response_rstart (d, DNS_T_A, 655360))
+            if (!response_rstart (z->r, d, DNS_T_A, 655360))
                 goto DIE;
-            if (!response_addbytes (misc, 4))
+            if (!response_addbytes (z->r, misc, 4))
                 goto DIE;
-            response_rfinish (RESPONSE_ANSWER);
+            response_rfinish (z->r, RESPONSE_ANSWER);
         }
         cleanup (z);
 
@@ -318,16 +583,16 @@ NEWNAME:
             goto DIE;
         if (typematch (DNS_T_PTR, dtype))
         {
-            if (!response_rstart (d, DNS_T_PTR, 655360))
+            if (!response_rstart (z->r, d, DNS_T_PTR, 655360))
                 goto DIE;
-            if (!response_addname ("\011localhost\0"))
+            if (!response_addname (z->r, "\011localhost\0"))
                 goto DIE;
 
-            response_rfinish (RESPONSE_ANSWER);
+            response_rfinish (z->r, RESPONSE_ANSWER);
         }
         cleanup (z);
         if (debug_level > 2)
-            log_stats (uactive, tactive, numqueries, cache_motion);
+            stats ();
 
         return 1;
     }
@@ -356,7 +621,7 @@ NEWNAME:
 
                 if (!rqa (z))
                     goto DIE;
-                if (!response_cname (z->name[0], cached, ttl))
+                if (!response_cname (z->r, z->name[0], cached, ttl))
                     goto DIE;
                 cleanup (z);
 
@@ -383,14 +648,14 @@ NEWNAME:
                     goto DIE;
 
                 pos = 0;
-                while ((pos=dns_packet_getname (cached, cachedlen, pos, &t2)))
+                while ((pos=dns_packet_copyname (cached, cachedlen, pos, t2)))
                 {
-                    if (!response_rstart (d, DNS_T_NS, ttl))
+                    if (!response_rstart (z->r, d, DNS_T_NS, ttl))
                         goto DIE;
-                    if (!response_addname (t2))
+                    if (!response_addname (z->r, t2))
                         goto DIE;
 
-                    response_rfinish (RESPONSE_ANSWER);
+                    response_rfinish (z->r, RESPONSE_ANSWER);
                 }
                 cleanup (z);
 
@@ -410,14 +675,14 @@ NEWNAME:
                     goto DIE;
 
                 pos = 0;
-                while ((pos=dns_packet_getname (cached, cachedlen, pos, &t2)))
+                while ((pos=dns_packet_copyname (cached, cachedlen, pos, t2)))
                 {
-                    if (!response_rstart (d, DNS_T_PTR, ttl))
+                    if (!response_rstart (z->r, d, DNS_T_PTR, ttl))
                         goto DIE;
-                    if (!response_addname (t2))
+                    if (!response_addname (z->r, t2))
                         goto DIE;
 
-                    response_rfinish (RESPONSE_ANSWER);
+                    response_rfinish (z->r, RESPONSE_ANSWER);
                 }
                 cleanup(z);
 
@@ -439,17 +704,17 @@ NEWNAME:
                 pos = 0;
                 while ((pos=dns_packet_copy (cached, cachedlen, pos, misc, 2)))
                 {
-                    pos = dns_packet_getname (cached, cachedlen, pos, &t2);
+                    pos = dns_packet_copyname (cached, cachedlen, pos, t2);
                     if (!pos)
                         break;
-                    if (!response_rstart (d, DNS_T_MX, ttl))
+                    if (!response_rstart (z->r, d, DNS_T_MX, ttl))
                         goto DIE;
-                    if (!response_addbytes (misc, 2))
+                    if (!response_addbytes (z->r, misc, 2))
                         goto DIE;
-                    if (!response_addname (t2))
+                    if (!response_addname (z->r, t2))
                         goto DIE;
 
-                    response_rfinish (RESPONSE_ANSWER);
+                    response_rfinish (z->r, RESPONSE_ANSWER);
                 }
                 cleanup (z);
 
@@ -470,24 +735,24 @@ NEWNAME:
                 pos = 0;
                 while ((pos=dns_packet_copy(cached, cachedlen, pos, misc, 20)))
                 {
-                    pos = dns_packet_getname (cached, cachedlen, pos, &t2);
+                    pos = dns_packet_copyname (cached, cachedlen, pos, t2);
                     if (!pos)
                         break;
 
-                    pos = dns_packet_getname (cached, cachedlen, pos, &t3);
+                    pos = dns_packet_copyname (cached, cachedlen, pos, t3);
                     if (!pos)
                         break;
 
-                    if (!response_rstart (d, DNS_T_SOA, ttl))
+                    if (!response_rstart (z->r, d, DNS_T_SOA, ttl))
                         goto DIE;
-                    if (!response_addname (t2))
+                    if (!response_addname (z->r, t2))
                         goto DIE;
-                    if (!response_addname (t3))
+                    if (!response_addname (z->r, t3))
                         goto DIE;
-                    if (!response_addbytes(misc, 20))
+                    if (!response_addbytes(z->r, misc, 20))
                         goto DIE;
 
-                    response_rfinish (RESPONSE_ANSWER);
+                    response_rfinish (z->r, RESPONSE_ANSWER);
                 }
                 cleanup (z);
                 return 1;
@@ -528,11 +793,11 @@ NEWNAME:
                     goto DIE;
                 while (cachedlen >= 4)
                 {
-                    if (!response_rstart (d, DNS_T_A, ttl))
+                    if (!response_rstart (z->r, d, DNS_T_A, ttl))
                         goto DIE;
-                    if (!response_addbytes (cached, 4))
+                    if (!response_addbytes (z->r, cached, 4))
                         goto DIE;
-                    response_rfinish (RESPONSE_ANSWER);
+                    response_rfinish (z->r, RESPONSE_ANSWER);
                     cached += 4;
                     cachedlen -= 4;
                 }
@@ -566,11 +831,11 @@ NEWNAME:
                     cachedlen -= 2;
                     if (datalen > cachedlen)
                         goto DIE;
-                    if (!response_rstart (d, dtype, ttl))
+                    if (!response_rstart (z->r, d, dtype, ttl))
                         goto DIE;
-                    if (!response_addbytes (cached, datalen))
+                    if (!response_addbytes (z->r, cached, datalen))
                         goto DIE;
-                    response_rfinish (RESPONSE_ANSWER);
+                    response_rfinish (z->r, RESPONSE_ANSWER);
                     cached += datalen;
                     cachedlen -= datalen;
                 }
@@ -579,10 +844,31 @@ NEWNAME:
                 return 1;
             }
         }
+
+        if (nxcut (z, d))
+        {
+            if (debug_level > 2)
+                log_cachednxdomain (d);
+            goto NXDOMAIN;
+        }
     }
 
+    /*
+     * Find the deepest cached delegation from the index, rather than by
+     * probing the cache for NS records at every suffix of d. Names with no
+     * indexed delegation are looked up the long way, in case the index
+     * has forgotten one that is still in the cache.
+     */
+    cut = 0;
+    if (!flagforwardonly && (z->level < 2))
+    {
+        flagcut = deleg_find (d, &pos, cutservers);
+        if (flagcut)
+            cut = d + pos;
+    }
     for (;;)
     {
+        z->serversttl[z->level] = 0xffffffff;
         if (roots (z->servers[z->level], d))
         {
             for (j = 0; j < QUERY_MAXNS; ++j)
@@ -591,8 +877,18 @@ NEWNAME:
             break;
         }
 
-        if (!flagforwardonly && (z->level < 2))
+        if (!flagforwardonly && (z->level < 2) && (!cut || d == cut))
         {
+            if (cut && flagcut == 2)
+            {
+                if (debug_level > 2)
+                    log_cacheddeleg (d, cutservers);
+                z->control[z->level] = d;
+                byte_copy (z->servers[z->level], 64, cutservers);
+                for (j = 0; j < QUERY_MAXNS; ++j)
+                    dns_domain_free (&z->ns[z->level][j]);
+                break;
+            }
             if (dlen < 255)
             {
                 byte_copy (key,2,DNS_T_NS);
@@ -607,7 +903,7 @@ NEWNAME:
                         dns_domain_free (&z->ns[z->level][j]);
 
                     j = pos = 0;
-                    pos = dns_packet_getname (cached, cachedlen, pos, &t1);
+                    pos = dns_packet_copyname (cached, cachedlen, pos, t1);
                     while (pos)
                     {
                         if (debug_level > 2)
@@ -616,11 +912,12 @@ NEWNAME:
                             if (!dns_domain_copy (&z->ns[z->level][j++], t1))
                                 goto DIE;
 
-                        pos = dns_packet_getname (cached, cachedlen, pos, &t1);
+                        pos = dns_packet_copyname (cached, cachedlen, pos, t1);
                     }
                     break;
                 }
             }
+            cut = 0;    /* the index was stale, try every suffix from here */
         }
 
         if (!*d)
@@ -632,32 +929,76 @@ NEWNAME:
 
 
 HAVENS:
+    /*
+     * Name servers whose addresses are in the cache are used right away.
+     * The others are looked up one at a time, but only while there is no
+     * server left to send to: the query goes out as soon as one address is
+     * known, and the remaining names wait in case those servers fail.
+     */
     for (j = 0; j < QUERY_MAXNS; ++j)
+        if (z->ns[z->level][j] && nscached (z->servers[z->level],
+                            &z->serversttl[z->level], z->ns[z->level][j]))
+            dns_domain_free (&z->ns[z->level][j]);
+
+    for (j = 0; j < 64; j += 4)
     {
-        if (z->ns[z->level][j])
+        if (byte_equal (z->servers[z->level] + j, 4, "\0\0\0\0"))
+            continue;
+        if (!lame_get (z->control[z->level], z->servers[z->level] + j))
+            continue;
+        if (debug_level > 2)
+            log_cachedlame (z->servers[z->level] + j, z->control[z->level]);
+        byte_zero (z->servers[z->level] + j, 4);
+    }
+
+    for (j = 0; j < 64; j += 4)
+        if (byte_diff (z->servers[z->level] + j, 4, "\0\0\0\0"))
+            break;
+    for (k = 0; (j == 64) && (k < QUERY_MAXNS); ++k)
+    {
+        if (z->ns[z->level][k])
         {
             if (z->level + 1 < QUERY_MAXLEVEL)
             {
                 int dc = dns_domain_copy (&z->name[z->level + 1],
-                                                    z->ns[z->level][j]);
+                                                    z->ns[z->level][k]);
                 if (!dc)
                     goto DIE;
 
-                dns_domain_free (&z->ns[z->level][j]);
+                dns_domain_free (&z->ns[z->level][k]);
                 ++z->level;
                 goto NEWNAME;
             }
-            dns_domain_free (&z->ns[z->level][j]);
+            dns_domain_free (&z->ns[z->level][k]);
         }
     }
-
-    for (j = 0; j < 64; j += 4)
-        if (byte_diff (z->servers[z->level] + j, 4, "\0\0\0\0"))
-            break;
     if (j == 64)
         goto SERVFAIL;
+    if (flagcacheonly)
+    {
+        missedcache = 1;
+        errno = error_busy;
+        goto DIE;
+    }
 
-    dns_sortip (z->servers[z->level], 64);
+    /*
+     * With name servers still to look up, give the known ones a single
+     * round of attempts; if they all fail we try the others.
+     */
+    for (k = 0; k < QUERY_MAXNS; ++k)
+        if (z->ns[z->level][k])
+            break;
+    z->dt.maxloop = (k < QUERY_MAXNS) ? 1 : 0;
+    if (!flagforwardonly && (z->level < 2) && (k == QUERY_MAXNS))
+        deleg_setservers (z->control[z->level], z->servers[z->level],
+                                                z->serversttl[z->level]);
+    dns_infra_sortip (z->servers[z->level], 64);
+    if (!zonehold (z, z->control[z->level]))
+    {
+        if (debug_level > 1)
+            log_servfail (z->name[z->level]);
+        goto SERVFAIL;
+    }
     if (z->level)
     {
         if (debug_level > 2)
@@ -666,12 +1007,12 @@ HAVENS:
 
         if (dns_transmit_start (&z->dt, z->servers[z->level], flagforwardonly,
                                 z->name[z->level], DNS_T_A, z->localip) == -1)
-            goto DIE;
+            goto BUSY;
     }
     else
     {
-        if (bl.map
-            && cdb_find (&bl, z->name[0], dns_domain_length (z->name[0])) > 0)
+        /* the name may be an alias of a blocked one */
+        if (dnsbl_match (z->name[0]))
         {
             errno = error_blockedbydbl;
             goto DIE;
@@ -681,11 +1022,20 @@ HAVENS:
 
         if (dns_transmit_start (&z->dt, z->servers[0], flagforwardonly,
                                 z->name[0], z->type, z->localip) == -1)
-            goto DIE;
+            goto BUSY;
     }
     return 0;
 
 
+BUSY:
+    /* every server was skipped for having too many queries outstanding */
+    if (errno != error_busy)
+        goto DIE;
+    if (debug_level > 1)
+        log_servfail (z->name[z->level]);
+    goto SERVFAIL;
+
+
 LOWERLEVEL:
     dns_domain_free (&z->name[z->level]);
     for (j = 0; j < QUERY_MAXNS; ++j)
@@ -724,7 +1074,7 @@ HAVEPACKET:
     flagout = flagcname = flagreferral = 0;
     for (j = 0; j < numanswers; ++j)
     {
-        pos = dns_packet_getname (buf, len, pos, &t1);
+        pos = dns_packet_copyname (buf, len, pos, t1);
         if (!pos)
             goto DIE;
         pos = dns_packet_copy (buf, len, pos, header, 10);
@@ -754,7 +1104,7 @@ HAVEPACKET:
 
     for (j = 0; j < numauthority; ++j)
     {
-        pos = dns_packet_getname (buf, len, pos, &t1);
+        pos = dns_packet_copyname (buf, len, pos, t1);
         if (!pos)
             goto DIE;
         pos = dns_packet_copy (buf, len, pos, header, 10);
@@ -786,6 +1136,7 @@ HAVEPACKET:
         {
             if (debug_level > 2)
                 log_lame (whichserver, control, referral);
+            lame_set (control, whichserver);
             byte_zero (whichserver, 4);
 
             goto HAVENS;
@@ -799,35 +1150,46 @@ HAVEPACKET:
     }
 
     k = numanswers + numauthority + numglue;
-    records = (unsigned int *) alloc (k * sizeof (unsigned int));
+    records = (struct rr *) alloc (k * sizeof (struct rr));
     if (!records)
         goto DIE;
 
     pos = posanswers;
     for (j = 0; j < k; ++j)
     {
-        records[j] = pos;
-        pos = dns_packet_getname (buf, len, pos, &t1);
+        records[j].pos = pos;
+        pos = dns_packet_copyname (buf, len, pos, t1);
         if (!pos)
             goto DIE;
         pos = dns_packet_copy (buf, len, pos, header, 10);
         if (!pos)
             goto DIE;
         uint16_unpack_big (header + 8, &datalen);
+        if (datalen > len - pos)
+            goto DIE;
+
+        records[j].hash = dns_domain_hash (t1, dns_domain_length (t1), 5381);
+        byte_copy (records[j].type, 2, header);
+        byte_copy (records[j].class, 2, header + 2);
+        records[j].ttl = ttlget (header + 4);
+        records[j].data = pos;
+        records[j].datalen = datalen;
         pos += datalen;
     }
 
     i = j = k;
     while (j > 1)
     {
+        struct rr x;
+
         if (i > 1)
         {
             --i;
-            pos = records[i - 1];
+            x = records[i - 1];
         }
         else
         {
-            pos = records[j - 1];
+            x = records[j - 1];
             records[j - 1] = records[i - 1];
             --j;
         }
@@ -835,7 +1197,7 @@ HAVEPACKET:
         q = i;
         while ((p = q * 2) < j)
         {
-            if (!smaller (buf, len, records[p], records[p - 1]))
+            if (!smaller (buf, len, records + p, records + p - 1))
                 ++p;
             records[q - 1] = records[p - 1];
             q = p;
@@ -845,12 +1207,12 @@ HAVEPACKET:
             records[q - 1] = records[p - 1];
             q = p;
         }
-        while ((q > i) && smaller (buf, len, records[(p = q/2) - 1], pos))
+        while ((q > i) && smaller (buf, len, records + (p = q/2) - 1, &x))
         {
             records[q - 1] = records[p - 1];
             q = p;
         }
-        records[q - 1] = pos;
+        records[q - 1] = x;
     }
 
     i = 0;
@@ -858,34 +1220,20 @@ HAVEPACKET:
     {
         char type[2];
 
-        if (!(pos = dns_packet_getname (buf, len, records[i], &t1)))
-            goto DIE;
-        if (!(pos = dns_packet_copy (buf, len, pos, header, 10)))
+        if (!dns_packet_copyname (buf, len, records[i].pos, t1))
             goto DIE;
-        ttl = ttlget (header + 4);
+        ttl = records[i].ttl;
 
-        byte_copy (type, 2, header);
-        if (byte_diff (header + 2, 2, DNS_C_IN))
+        byte_copy (type, 2, records[i].type);
+        if (byte_diff (records[i].class, 2, DNS_C_IN))
         {
             ++i;
             continue;
         }
 
         for (j = i + 1; j < k; ++j)
-        {
-            pos = dns_packet_getname (buf, len, records[j], &t2);
-            if (!pos)
-                goto DIE;
-            pos = dns_packet_copy (buf, len, pos, header, 10);
-            if (!pos)
-                goto DIE;
-            if (!dns_domain_equal (t1, t2))
-                break;
-            if (byte_diff (header, 2, type))
+            if (!same (buf, len, records + i, records + j))
                 break;
-            if (byte_diff (header + 2, 2, DNS_C_IN))
-                break;
-        }
 
         if (!dns_domain_suffix (t1, control))
         {
@@ -917,19 +1265,16 @@ HAVEPACKET:
             save_start ();
             while (i < j)
             {
-                pos = dns_packet_skipname (buf, len, records[i]);
+                pos = dns_packet_copyname (buf, len, records[i].data, t2);
                 if (!pos)
                     goto DIE;
-                pos = dns_packet_getname (buf, len, pos + 10, &t2);
-                if (!pos)
-                    goto DIE;
-                pos = dns_packet_getname (buf, len, pos, &t3);
+                pos = dns_packet_copyname (buf, len, pos, t3);
                 if (!pos)
                     goto DIE;
                 pos = dns_packet_copy (buf, len, pos, misc, 20);
                 if (!pos)
                     goto DIE;
-                if (records[i] < posauthority)
+                if (records[i].pos < posauthority)
                 {
                       if (debug_level > 2)
                           log_rrsoa (whichserver, t1, t2, t3, misc, ttl);
@@ -945,11 +1290,7 @@ HAVEPACKET:
         }
         else if (byte_equal (type, 2, DNS_T_CNAME))
         {
-            pos = dns_packet_skipname (buf, len, records[j - 1]);
-            if (!pos)
-                goto DIE;
-            pos = dns_packet_getname (buf, len, pos + 10, &t2);
-            if (!pos)
+            if (!dns_packet_copyname (buf, len, records[j - 1].data, t2))
                 goto DIE;
 
             if (debug_level > 2)
@@ -962,11 +1303,7 @@ HAVEPACKET:
             save_start ();
             while (i < j)
             {
-                pos = dns_packet_skipname (buf, len, records[i]);
-                if (!pos)
-                    goto DIE;
-                pos = dns_packet_getname (buf, len, pos + 10, &t2);
-                if (!pos)
+                if (!dns_packet_copyname (buf, len, records[i].data, t2))
                     goto DIE;
                 if (debug_level > 2)
                     log_rrptr (whichserver, t1, t2, ttl);
@@ -981,11 +1318,7 @@ HAVEPACKET:
             save_start ();
             while (i < j)
             {
-                pos = dns_packet_skipname (buf, len, records[i]);
-                if (!pos)
-                    goto DIE;
-                pos = dns_packet_getname (buf, len, pos + 10, &t2);
-                if (!pos)
+                if (!dns_packet_copyname (buf, len, records[i].data, t2))
                     goto DIE;
                 if (debug_level > 2)
                     log_rrns (whichserver, t1, t2, ttl);
@@ -993,19 +1326,18 @@ HAVEPACKET:
                 ++i;
             }
             save_finish (DNS_T_NS, t1, ttl);
+            if (save_ok && !flagforwardonly)
+                deleg_set (t1, ttl);
         }
         else if (byte_equal (type, 2, DNS_T_MX))
         {
             save_start ();
             while (i < j)
             {
-                pos = dns_packet_skipname (buf, len, records[i]);
+                pos = dns_packet_copy (buf, len, records[i].data, misc, 2);
                 if (!pos)
                     goto DIE;
-                pos = dns_packet_copy (buf, len, pos + 10, misc, 2);
-                if (!pos)
-                    goto DIE;
-                pos = dns_packet_getname (buf, len, pos, &t2);
+                pos = dns_packet_copyname (buf, len, pos, t2);
                 if (!pos)
                     goto DIE;
                 if (debug_level > 2)
@@ -1021,21 +1353,13 @@ HAVEPACKET:
             save_start ();
             while (i < j)
             {
-                pos = dns_packet_skipname (buf, len, records[i]);
-                if (!pos)
-                    goto DIE;
-                pos = dns_packet_copy (buf, len, pos, header, 10);
-                if (!pos)
-                    goto DIE;
-                if (byte_equal (header + 8, 2, "\0\4"))
+                if (records[i].datalen == 4)
                 {
-                    pos = dns_packet_copy (buf, len, pos, header, 4);
-                    if (!pos)
-                        goto DIE;
-                    save_data (header, 4);
+                    save_data (buf + records[i].data, 4);
 
                     if (debug_level > 2)
-                        log_rr (whichserver, t1, DNS_T_A, header, 4, ttl);
+                        log_rr (whichserver, t1, DNS_T_A,
+                                            buf + records[i].data, 4, ttl);
                 }
                 ++i;
             }
@@ -1046,20 +1370,14 @@ HAVEPACKET:
             save_start ();
             while (i < j)
             {
-                pos = dns_packet_skipname (buf, len, records[i]);
-                if (!pos)
-                    goto DIE;
-                pos = dns_packet_copy (buf, len, pos, header, 10);
-                if (!pos)
-                    goto DIE;
-                uint16_unpack_big (header + 8, &datalen);
-                if (datalen > len - pos)
-                    goto DIE;
-                save_data (header + 8, 2);
-                save_data (buf + pos, datalen);
+                datalen = records[i].datalen;
+                uint16_pack_big (misc, datalen);
+                save_data (misc, 2);
+                save_data (buf + records[i].data, datalen);
 
                 if (debug_level > 2)
-                    log_rr (whichserver, t1, type, buf + pos, datalen, ttl);
+                    log_rr (whichserver, t1, type,
+                                    buf + records[i].data, datalen, ttl);
 
                 ++i;
             }
@@ -1099,6 +1417,8 @@ CNAME:
         if (debug_level > 2)
             log_nxdomain (whichserver, d, soattl);
         cachegeneric (DNS_T_ANY, d, "", 0, soattl);
+        if (z->zone)
+            zone_nxdomain (z->zone);
 
 NXDOMAIN:
         if (z->level)
@@ -1106,7 +1426,7 @@ NXDOMAIN:
         if (!rqa (z))
             goto DIE;
 
-        response_nxdomain ();
+        response_nxdomain (z->r);
         cleanup (z);
 
         return 1;
@@ -1124,7 +1444,7 @@ NXDOMAIN:
                 }
 
     if (debug_level > 2)
-        log_stats (uactive, tactive, numqueries, cache_motion);
+        stats ();
 
     if (flagout || flagsoa || !flagreferral)
     {
@@ -1133,7 +1453,7 @@ NXDOMAIN:
             pos = posanswers;
             for (j = 0; j < numanswers; ++j)
             {
-                pos = dns_packet_getname (buf, len, pos, &t1);
+                pos = dns_packet_copyname (buf, len, pos, t1);
                 if (!pos)
                     goto DIE;
                 pos = dns_packet_copy (buf, len, pos, header, 10);
@@ -1167,7 +1487,7 @@ NXDOMAIN:
         pos = posanswers;
         for (j = 0; j < numanswers; ++j)
         {
-            pos = dns_packet_getname (buf, len, pos, &t1);
+            pos = dns_packet_copyname (buf, len, pos, t1);
             if (!pos)
                 goto DIE;
             pos = dns_packet_copy (buf, len, pos, header, 10);
@@ -1181,16 +1501,16 @@ NXDOMAIN:
                 {   /* should always be true */
                     if (typematch (header, dtype))
                     {
-                        if (!response_rstart (t1, header, ttl))
+                        if (!response_rstart (z->r, t1, header, ttl))
                             goto DIE;
 
                         if (typematch (header, DNS_T_NS)
                             || typematch (header, DNS_T_CNAME)
                             || typematch (header, DNS_T_PTR))
                         {
-                            if (!dns_packet_getname (buf, len, pos, &t2))
+                            if (!dns_packet_copyname (buf, len, pos, t2))
                                 goto DIE;
-                            if (!response_addname (t2))
+                            if (!response_addname (z->r, t2))
                                 goto DIE;
                         }
                         else if (typematch (header, DNS_T_MX))
@@ -1198,39 +1518,39 @@ NXDOMAIN:
                             pos2 = dns_packet_copy (buf, len, pos, misc, 2);
                             if (!pos2)
                                 goto DIE;
-                            if (!response_addbytes (misc, 2))
+                            if (!response_addbytes (z->r, misc, 2))
                                 goto DIE;
-                            if (!dns_packet_getname (buf, len, pos2, &t2))
+                            if (!dns_packet_copyname (buf, len, pos2, t2))
                                 goto DIE;
-                            if (!response_addname (t2))
+                            if (!response_addname (z->r, t2))
                                 goto DIE;
                         }
                         else if (typematch (header, DNS_T_SOA))
                         {
-                            pos2 = dns_packet_getname (buf, len, pos, &t2);
+                            pos2 = dns_packet_copyname (buf, len, pos, t2);
                             if (!pos2)
                                 goto DIE;
-                            if (!response_addname (t2))
+                            if (!response_addname (z->r, t2))
                                 goto DIE;
-                            pos2 = dns_packet_getname (buf, len, pos2, &t3);
+                            pos2 = dns_packet_copyname (buf, len, pos2, t3);
                             if (!pos2)
                                 goto DIE;
-                            if (!response_addname (t3))
+                            if (!response_addname (z->r, t3))
                                 goto DIE;
                             pos2 = dns_packet_copy (buf, len, pos2, misc, 20);
                             if (!pos2)
                                 goto DIE;
-                            if (!response_addbytes (misc, 20))
+                            if (!response_addbytes (z->r, misc, 20))
                                 goto DIE;
                         }
                         else
                         {
                             if (pos + datalen > len)
                                 goto DIE;
-                            if (!response_addbytes (buf + pos, datalen))
+                            if (!response_addbytes (z->r, buf + pos, datalen))
                                 goto DIE;
                         }
-                        response_rfinish(RESPONSE_ANSWER);
+                        response_rfinish(z->r, RESPONSE_ANSWER);
                     }
                 }
             }
@@ -1246,6 +1566,7 @@ NXDOMAIN:
     control = d + dns_domain_suffixpos (d, referral);
     z->control[z->level] = control;
     byte_zero (z->servers[z->level], 64);
+    z->serversttl[z->level] = 0xffffffff;
     for (j = 0; j < QUERY_MAXNS; ++j)
         dns_domain_free (&z->ns[z->level][j]);
     k = 0;
@@ -1253,7 +1574,7 @@ NXDOMAIN:
     pos = posauthority;
     for (j = 0; j < numauthority; ++j)
     {
-        pos = dns_packet_getname (buf, len, pos, &t1);
+        pos = dns_packet_copyname (buf, len, pos, t1);
         if (!pos)
             goto DIE;
         pos = dns_packet_copy (buf, len, pos, header, 10);
@@ -1280,7 +1601,7 @@ SERVFAIL:
         goto LOWERLEVEL;
     if (!rqa (z))
         goto DIE;
-    response_servfail ();
+    response_servfail (z->r);
     cleanup (z);
 
     return 1;
@@ -1298,8 +1619,8 @@ DIE:
 }
 
 int
-query_start (struct query *z, char *dn, char type[2],
-                              char class[2], char localip[4])
+query_start (struct query *z, struct response *r, char *dn, char type[2],
+                                            char class[2], char localip[4])
 {
     if (byte_equal (type, 2, DNS_T_AXFR))
     {
@@ -1310,6 +1631,7 @@ query_start (struct query *z, char *dn, char type[2],
     cleanup (z);
     z->level = 0;
     z->loop = 0;
+    z->nxcut = 0;
 
     if (!dns_domain_copy (&z->name[0], dn))
         return -1;
@@ -1317,10 +1639,29 @@ query_start (struct query *z, char *dn, char type[2],
     byte_copy (z->type, 2, type);
     byte_copy (z->class, 2, class);
     byte_copy (z->localip, 4, localip);
+    z->r = r;
 
     return doit (z, 0);
 }
 
+/*
+ * query_cached: like query_start, but answer only from the cache. Returns 0,
+ * having sent nothing, if that would take a query to some server.
+ */
+int
+query_cached (struct query *z, struct response *r, char *dn, char type[2],
+                                            char class[2], char localip[4])
+{
+    int ret = 0;
+
+    flagcacheonly = 1;
+    missedcache = 0;
+    ret = query_start (z, r, dn, type, class, localip);
+    flagcacheonly = 0;
+
+    return (ret == -1 && missedcache) ? 0 : ret;
+}
+
 int
 query_get (struct query *z, iopause_fd *x, struct taia *stamp)
 {
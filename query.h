@@ -1,25 +1,32 @@
 #pragma once
 
 #include "dns.h"
+#include "response.h"
 #include "uint32.h"
+#include "uint64.h"
 
 #define QUERY_MAXNS 16
 #define QUERY_MAXLEVEL 5
 #define QUERY_MAXALIAS 16
+#define QUERY_MAXNXCUT 16  /* cache probes for a nonexistent ancestor */
 
 struct query
 {
     unsigned int loop;
     unsigned int level;
+    unsigned int nxcut; /* QUERY_MAXNXCUT probes made so far */
     char *name[QUERY_MAXLEVEL];
     char *control[QUERY_MAXLEVEL]; /* pointing inside name */
     char *ns[QUERY_MAXLEVEL][QUERY_MAXNS];
     char servers[QUERY_MAXLEVEL][64];
+    uint32 serversttl[QUERY_MAXLEVEL]; /* least TTL of their addresses */
     char *alias[QUERY_MAXALIAS];
     uint32 aliasttl[QUERY_MAXALIAS];
     char localip[4];
     char type[2];
     char class[2];
+    uint64 zone; /* zonestat id counted in flight for dt, 0 if none */
+    struct response *r; /* where the response is built */
     struct dns_transmit dt;
 };
 
@@ -29,4 +36,10 @@ extern void query_io (struct query *, iopause_fd *, struct taia *);
 
 extern int query_get (struct query *, iopause_fd *, struct taia *);
 
-extern int query_start (struct query *, char *, char *, char *, char *);
+extern void query_drop (struct query *);
+
+extern int query_start (struct query *, struct response *,
+                                        char *, char *, char *, char *);
+
+extern int query_cached (struct query *, struct response *,
+                                        char *, char *, char *, char *);
@@ -46,7 +46,7 @@ static char data[100 + IP4_FMT];
 extern char *cfgfile, *logfile, *pidfile;
 
 static int
-doit (char *q, char qtype[2])
+doit (struct response *res, char *q, char qtype[2])
 {
     int i = 0, r = 0;
     int flaga = 0, flagtxt = 0;
@@ -81,7 +81,7 @@ doit (char *q, char qtype[2])
     }
     if (!r)
     {
-        response_nxdomain ();
+        response_nxdomain (res);
         return 1;
     }
 
@@ -109,36 +109,36 @@ doit (char *q, char qtype[2])
 
     if (flaga)
     {
-        if (!response_rstart (q, DNS_T_A, 2048))
+        if (!response_rstart (res, q, DNS_T_A, 2048))
             return 0;
-        if (!response_addbytes (data, 4))
+        if (!response_addbytes (res, data, 4))
             return 0;
-        response_rfinish (RESPONSE_ANSWER);
+        response_rfinish (res, RESPONSE_ANSWER);
     }
     if (flagtxt)
     {
-        if (!response_rstart (q, DNS_T_TXT, 2048))
+        if (!response_rstart (res, q, DNS_T_TXT, 2048))
             return 0;
 
         ch = dlen - 4;
-        if (!response_addbytes (&ch, 1))
+        if (!response_addbytes (res, &ch, 1))
             return 0;
-        if (!response_addbytes (data + 4, dlen - 4))
+        if (!response_addbytes (res, data + 4, dlen - 4))
             return 0;
-        response_rfinish (RESPONSE_ANSWER);
+        response_rfinish (res, RESPONSE_ANSWER);
     }
     return 1;
 
 REFUSE:
-    response[2] &= ~4;
-    response[3] &= ~15;
-    response[3] |= 5;
+    res->buf[2] &= ~4;
+    res->buf[3] &= ~15;
+    res->buf[3] |= 5;
 
     return 1;
 }
 
 int
-respond (char *q, char qtype[2], char ip[4])
+respond (struct response *res, char *q, char qtype[2], char ip[4])
 {
     int fd = 0;
     int result = 0;
@@ -148,7 +148,7 @@ respond (char *q, char qtype[2], char ip[4])
         return (ip != ip); /* return 0; suppress warning: unused-parameter */
 
     cdb_init (&c, fd);
-    result = doit (q, qtype);
+    result = doit (res, q, qtype);
     cdb_free (&c);
     close (fd);
 
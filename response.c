@@ -22,90 +22,172 @@
 
 #include "dns.h"
 #include "byte.h"
+#include "case.h"
 #include "uint16.h"
 #include "response.h"
 
-char response[65535];
-static unsigned int tctarget;
-unsigned int response_len = 0; /* <= 65535 */
+/*
+ * A response is built in a struct response, which holds the packet and all
+ * that is needed to add to it. Any number of them may be built at once.
+ *
+ * Names already in a response are remembered for compression: every suffix
+ * written at an offset a compression pointer can reach is indexed in a hash
+ * table by its first label and the offset of the rest of it, the suffix
+ * that label is followed by (0 for the root). A name is then compressed by
+ * looking up its suffixes from the root down, one probe per label.
+ */
 
-#define NAMES 100
-static char name[NAMES][128];
-static unsigned int name_num;
-static unsigned int name_ptr[NAMES]; /* each < 16384 */
+static int flaghidettl = 0;
+
+/* response_init: make `r' ready for use; not needed if it is zeroed */
+void
+response_init (struct response *r)
+{
+    byte_zero (r->name_slot, sizeof (r->name_slot));
+    r->name_num = 0;
+    r->len = r->tctarget = r->dpos = 0;
+}
 
 int
-response_addbytes (const char *buf, unsigned int len)
+response_addbytes (struct response *r, const char *buf, unsigned int len)
 {
-    if (len > 65535 - response_len)
+    if (len > 65535 - r->len)
         return 0;
 
-    byte_copy (response + response_len, len,buf);
-    response_len += len;
+    byte_copy (r->buf + r->len, len, buf);
+    r->len += len;
 
     return 1;
 }
 
+static unsigned int
+name_hash (const char *label, unsigned int next)
+{
+    unsigned int h = dns_domain_hash (label, 1 + (unsigned char)*label, next);
+
+    return h & (RESPONSE_NAMESLOTS - 1);
+}
+
+/* name_next: the offset of the suffix after the label at `pos', or -1 */
+static int
+name_next (struct response *r, unsigned int pos)
+{
+    unsigned char ch = 0;
+
+    pos += 1 + (unsigned char)r->buf[pos];
+    if (pos >= r->len)
+        return -1;
+    ch = r->buf[pos];
+    if (!ch)
+        return 0;
+    if (ch < 192)
+        return pos;
+    if (pos + 1 >= r->len)
+        return -1;
+
+    return ((ch - 192) << 8) + (unsigned char)r->buf[pos + 1];
+}
+
+/* name_find: the offset of `label' followed by the suffix at `next', or 0 */
+static unsigned int
+name_find (struct response *r, const char *label, unsigned int next)
+{
+    unsigned int i = 0, pos = 0, len = (unsigned char)*label;
+
+    for (i = name_hash (label, next); (pos = r->name_slot[i]);
+                                        i = (i + 1) & (RESPONSE_NAMESLOTS - 1))
+    {
+        /* an entry may be stale, if the response was cut short since */
+        if (pos + 1 + len >= r->len || r->buf[pos] != *label)
+            continue;
+        if (case_diffb (r->buf + pos + 1, len, label + 1))
+            continue;
+        if (name_next (r, pos) == (int)next)
+            return pos;
+    }
+
+    return 0;
+}
+
+static void
+name_insert (struct response *r, unsigned int pos, unsigned int next)
+{
+    unsigned int i = 0;
+
+    if (pos >= 16384 || r->name_num >= RESPONSE_NAMES)
+        return;
+
+    for (i = name_hash (r->buf + pos, next); r->name_slot[i];
+                                        i = (i + 1) & (RESPONSE_NAMESLOTS - 1))
+        ;
+    r->name_slot[i] = pos;
+    r->name_used[r->name_num++] = i;
+}
+
 int
-response_addname (const char *d)
+response_addname (struct response *r, const char *d)
 {
     char buf[2];
-    unsigned int i = 0, dlen = 0;
+    const char *label[128];
+    unsigned int pos[128];
+    unsigned int i = 0, n = 0, next = 0, found = 0;
 
-    dlen = dns_domain_length (d);
+    for (n = 0; *d && n < 128; d += 1 + (unsigned char)*d)
+        label[n++] = d;
 
-    while (*d)
+    /* the longest suffix of `d' already in the response */
+    while (n && (found = name_find (r, label[n - 1], next)))
     {
-        for (i = 0; i < name_num; ++i)
-        {
-            if (dns_domain_equal (d, name[i]))
-            {
-                uint16_pack_big (buf, 49152 + name_ptr[i]);
-                return response_addbytes (buf, 2);
-            }
-        }
-        if ((dlen <= 128) && (response_len < 16384))
-        {
-            if (name_num < NAMES)
-            {
-                byte_copy (name[name_num], dlen, d);
-                name_ptr[name_num] = response_len;
-                ++name_num;
-            }
-        }
-        i = (unsigned char)*d;
-        if (!response_addbytes (d, ++i))
+        next = found;
+        n--;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        pos[i] = r->len;
+        if (!response_addbytes (r, label[i], 1 + (unsigned char)*label[i]))
             return 0;
+    }
+    if (next)
+    {
+        uint16_pack_big (buf, 49152 + next);
+        if (!response_addbytes (r, buf, 2))
+            return 0;
+    }
+    else if (!response_addbytes (r, "", 1))
+        return 0;
 
-        d += i;
-        dlen -= i;
+    while (n--)
+    {
+        name_insert (r, pos[n], next);
+        next = pos[n];
     }
 
-    return response_addbytes (d, 1);
+    return 1;
 }
 
 int
-response_query (const char *q, const char qtype[2], const char qclass[2])
+response_query (struct response *r,
+                const char *q, const char qtype[2], const char qclass[2])
 {
-    response_len = name_num = 0;
+    while (r->name_num)
+        r->name_slot[r->name_used[--r->name_num]] = 0;
+    r->len = 0;
 
-    if (!response_addbytes ("\0\0\201\200\0\1\0\0\0\0\0\0", 12))
+    if (!response_addbytes (r, "\0\0\201\200\0\1\0\0\0\0\0\0", 12))
         return 0;
-    if (!response_addname (q))
+    if (!response_addname (r, q))
         return 0;
-    if (!response_addbytes (qtype, 2))
+    if (!response_addbytes (r, qtype, 2))
         return 0;
-    if (!response_addbytes (qclass, 2))
+    if (!response_addbytes (r, qclass, 2))
         return 0;
 
-    tctarget = response_len;
+    r->tctarget = r->len;
 
     return 1;
 }
 
-static unsigned int dpos;
-static int flaghidettl = 0;
-
 void
 response_hidettl (void)
 {
@@ -113,71 +195,72 @@ response_hidettl (void)
 }
 
 int
-response_rstart (const char *d, const char type[2], uint32 ttl)
+response_rstart (struct response *r,
+                const char *d, const char type[2], uint32 ttl)
 {
     char ttlstr[4];
 
-    if (!response_addname (d))
+    if (!response_addname (r, d))
         return 0;
-    if (!response_addbytes (type, 2))
+    if (!response_addbytes (r, type, 2))
         return 0;
-    if (!response_addbytes (DNS_C_IN, 2))
+    if (!response_addbytes (r, DNS_C_IN, 2))
         return 0;
     if (flaghidettl)
         ttl = 0;
 
     uint32_pack_big (ttlstr, ttl);
-    if (!response_addbytes (ttlstr, 4))
+    if (!response_addbytes (r, ttlstr, 4))
         return 0;
-    if (!response_addbytes ("\0\0", 2))
+    if (!response_addbytes (r, "\0\0", 2))
         return 0;
 
-    dpos = response_len;
+    r->dpos = r->len;
     return 1;
 }
 
 void
-response_rfinish (int x)
+response_rfinish (struct response *r, int x)
 {
-    uint16_pack_big (response + dpos - 2, response_len - dpos);
-    if (!++response[x + 1])
-        ++response[x];
+    uint16_pack_big (r->buf + r->dpos - 2, r->len - r->dpos);
+    if (!++r->buf[x + 1])
+        ++r->buf[x];
 }
 
 int
-response_cname (const char *c, const char *d, uint32 ttl)
+response_cname (struct response *r, const char *c, const char *d, uint32 ttl)
 {
-    if (!response_rstart (c, DNS_T_CNAME, ttl))
+    if (!response_rstart (r, c, DNS_T_CNAME, ttl))
         return 0;
-    if (!response_addname (d))
+    if (!response_addname (r, d))
         return 0;
-    response_rfinish (RESPONSE_ANSWER);
+    response_rfinish (r, RESPONSE_ANSWER);
 
     return 1;
 }
 
 void
-response_nxdomain (void)
+response_nxdomain (struct response *r)
 {
-    response[3] |= 3;
-    response[2] |= 4;
+    r->buf[3] |= 3;
+    r->buf[2] |= 4;
 }
 
 void
-response_servfail (void)
+response_servfail (struct response *r)
 {
-    response[3] |= 2;
+    r->buf[3] |= 2;
 }
 
 void
-response_id (const char id[2])
+response_id (struct response *r, const char id[2])
 {
-    byte_copy (response, 2, id);
+    byte_copy (r->buf, 2, id);
 }
 
 void
-response_tc (void)
+response_tc (struct response *r)
 {
-    response[2] |= 2;
-    response_len = tctarget;
+    r->buf[2] |= 2;
+    r->len = r->tctarget;
 }
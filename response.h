@@ -1,24 +1,37 @@
 #pragma once
 
+#include "uint16.h"
 #include "uint32.h"
 
-extern char response[];
-extern unsigned int response_len;
+#define RESPONSE_NAMES 8192         /* suffixes in 16384 bytes, 2 each */
+#define RESPONSE_NAMESLOTS 16384    /* power of 2 */
 
-extern int response_query(const char *,const char *,const char *);
-extern void response_nxdomain(void);
-extern void response_servfail(void);
-extern void response_id(const char *);
-extern void response_tc(void);
+struct response
+{
+    char buf[65535];
+    unsigned int len;               /* <= 65535 */
+    unsigned int tctarget;          /* len of the question alone */
+    unsigned int dpos;              /* where the record being added starts */
+    unsigned int name_num;
+    uint16 name_slot[RESPONSE_NAMESLOTS];   /* suffix offset, 0 if free */
+    uint16 name_used[RESPONSE_NAMES];       /* slots to clear */
+};
 
-extern int response_addbytes(const char *,unsigned int);
-extern int response_addname(const char *);
+extern void response_init(struct response *);
+extern int response_query(struct response *,const char *,const char *,const char *);
+extern void response_nxdomain(struct response *);
+extern void response_servfail(struct response *);
+extern void response_id(struct response *,const char *);
+extern void response_tc(struct response *);
+
+extern int response_addbytes(struct response *,const char *,unsigned int);
+extern int response_addname(struct response *,const char *);
 extern void response_hidettl(void);
-extern int response_rstart(const char *,const char *,uint32);
-extern void response_rfinish(int);
+extern int response_rstart(struct response *,const char *,const char *,uint32);
+extern void response_rfinish(struct response *,int);
 
 #define RESPONSE_ANSWER 6
 #define RESPONSE_AUTHORITY 8
 #define RESPONSE_ADDITIONAL 10
 
-extern int response_cname(const char *,const char *,uint32);
+extern int response_cname(struct response *,const char *,const char *,uint32);
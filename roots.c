@@ -32,6 +32,7 @@
 #include "dns.h"
 #include "str.h"
 #include "byte.h"
+#include "alloc.h"
 #include "open.h"
 #include "error.h"
 #include "roots.h"
@@ -39,21 +40,59 @@
 
 static stralloc data;
 
+/*
+ * Index into data: an open addressing hash table of 1 + the offset of each
+ * zone name, keyed by the lower-cased name. Finding a zone takes one probe
+ * or so, however many servers/ files there are.
+ */
+static unsigned int *zones;
+static unsigned int zonesize;       /* power of 2 */
+
 static int
 roots_find (char *q)
 {
-    int i = 0, j = 0;
+    unsigned int i = 0, r = 0;
+
+    if (!zonesize)
+        return -1;
+
+    i = dns_domain_hash (q, dns_domain_length (q), 5381) & (zonesize - 1);
+    for (; (r = zones[i]); i = (i + 1) & (zonesize - 1))
+        if (dns_domain_equal (data.s + r - 1, q))
+            return r - 1 + dns_domain_length (q);
+
+    return -1;
+}
+
+static int
+roots_index (void)
+{
+    unsigned int i = 0, j = 0, n = 0;
+
+    for (i = 0; i < data.len; i += dns_domain_length (data.s + i) + 64)
+        n++;
+    for (j = 16; j < 2 * n; j <<= 1)
+        ;
+
+    if (zones)
+        alloc_free (zones);
+    if (!(zones = (unsigned int *)alloc (j * sizeof (*zones))))
+        return 0;
+    byte_zero (zones, j * sizeof (*zones));
+    zonesize = j;
 
-    while ((unsigned)i < data.len)
+    for (i = 0; i < data.len; i += dns_domain_length (data.s + i) + 64)
     {
-        j = dns_domain_length (data.s + i);
-        if (dns_domain_equal (data.s + i, q))
-            return i + j;
-        i += j;
-        i += 64;
+        if (roots_find (data.s + i) != -1)
+            continue;   /* the first one wins */
+
+        j = dns_domain_hash (data.s + i, dns_domain_length (data.s + i), 5381);
+        for (j &= zonesize - 1; zones[j]; j = (j + 1) & (zonesize - 1))
+            ;
+        zones[j] = 1 + i;
     }
 
-    return -1;
+    return 1;
 }
 
 static int
@@ -217,6 +256,8 @@ roots_init (void)
     if (fchdir (fddir) == -1)
         r = 0;
     close(fddir);
+    if (r && !roots_index ())
+        r = 0;
 
     return r;
 }
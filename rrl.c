@@ -0,0 +1,229 @@
+/*
+ * rrl.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <unistd.h>
+
+#include "dns.h"
+#include "rrl.h"
+#include "byte.h"
+#include "case.h"
+#include "taia.h"
+#include "uint16.h"
+#include "uint32.h"
+#include "uint64.h"
+#include "siphash.h"
+
+/*
+ * Response rate limiting. A server answering UDP queries will send its
+ * answers to whatever source address a query claims, so it can be used to
+ * flood a victim with answers much larger than the queries. Legitimate
+ * clients, caches mostly, rarely need the same answer many times a second,
+ * whereas a flood does.
+ *
+ * So responses are counted by who they go to, a network of the configured
+ * prefix length, what kind they are, and what they are about: the name
+ * asked for if it exists, or else the zone, as named by the owner of the
+ * first authority record, so that asking for many random names in one zone
+ * does not spread over many counts. Each count is a token bucket allowing
+ * `rate' responses per second. Beyond that responses are dropped, except
+ * that every `slip'th one is sent truncated, with no records in it: a real
+ * client then asks again over TCP, which can not be spoofed, and so is
+ * still answered during an attack, while a victim gets no more than it
+ * would from a refused query.
+ *
+ * The counts are kept in a fixed size set-associative table; when a set is
+ * full the least recently used count is forgotten.
+ */
+
+#define RRL_WAYS 4
+#define RRL_SLOTS 16384             /* power of 2 */
+
+#define KIND_ANSWER 0
+#define KIND_NODATA 1               /* no records, or a referral */
+#define KIND_NXDOMAIN 2
+#define KIND_ERROR 3
+
+struct bucket
+{
+    uint64 id;                      /* 0 if the slot is free */
+    uint64 tokens;                  /* responses allowed now, x 1000 */
+    uint64 stamp;                   /* millisecond of last use */
+    uint32 slips;                   /* responses over the rate */
+};
+
+static struct bucket bucket[RRL_SLOTS];
+static unsigned char rrl_key[16];
+static unsigned int rrl_rate;
+static unsigned int rrl_slip;
+static uint32 rrl_mask;
+uint64 rrl_limited = 0;             /* responses dropped */
+uint64 rrl_slipped = 0;             /* responses sent truncated */
+
+/*
+ * rrl_init: allow `rate' responses per second of a kind, 0 for no limit, to
+ * a network of `prefix' bits, 0 to 32, and send every `slip'th one beyond
+ * that truncated, 0 for none. A prefix of 0 counts all clients as one.
+ */
+void
+rrl_init (unsigned int rate, unsigned int slip, unsigned int prefix)
+{
+    struct taia now;
+    unsigned int i = 0;
+    char buf[TAIA_PACK];
+
+    /* the servers do not seed dns_random, see tinydns.c */
+    taia_now (&now);
+    taia_pack (buf, &now);
+    for (i = 0; i < sizeof (rrl_key); i++)
+        rrl_key[i] = (unsigned char) dns_random (0x100) ^ buf[i % TAIA_PACK]
+                                                    ^ (getpid () >> i % 16);
+
+    if (prefix > 32)
+        prefix = 32;
+    /* shifting a 32-bit value by 32 is undefined */
+    rrl_mask = prefix ? 0xffffffff << (32 - prefix) : 0;
+    rrl_rate = rate;
+    rrl_slip = slip;
+}
+
+/* zone: the owner of the first authority record in `buf', or 0 */
+static const char *
+zone (const char *buf, unsigned int len)
+{
+    uint16 n = 0, dlen = 0;
+    static char dn[255];
+    char header[12], misc[10];
+    unsigned int pos = 0;
+
+    if (!(pos = dns_packet_copy (buf, len, 0, header, 12)))
+        return 0;
+    if (!(pos = dns_packet_skipname (buf, len, pos)))
+        return 0;
+    pos += 4;
+
+    uint16_unpack_big (header + 6, &n);
+    while (n--)
+    {
+        if (!(pos = dns_packet_skipname (buf, len, pos)))
+            return 0;
+        if (!(pos = dns_packet_copy (buf, len, pos, misc, 10)))
+            return 0;
+        uint16_unpack_big (misc + 8, &dlen);
+        pos += dlen;
+    }
+
+    uint16_unpack_big (header + 8, &n);
+    if (!n || !dns_packet_copyname (buf, len, pos, dn))
+        return 0;
+
+    return dn;
+}
+
+static struct bucket *
+find (uint64 id)
+{
+    unsigned int i = 0;
+    struct bucket *e = bucket + (id & (RRL_SLOTS - RRL_WAYS)), *old = 0;
+
+    for (i = 0; i < RRL_WAYS; i++)
+    {
+        if (e[i].id == id)
+            return e + i;
+        if (!old || !e[i].id || (old->id && e[i].stamp < old->stamp))
+            old = e + i;
+    }
+
+    byte_zero (old, sizeof (*old));
+    old->id = id;
+    old->tokens = (uint64)rrl_rate * 1000;
+
+    return old;
+}
+
+/*
+ * rrl_check: what to do with the response `buf' of `len' bytes about to be
+ * sent to `ip': RRL_SEND, RRL_DROP or RRL_SLIP.
+ */
+int
+rrl_check (const char *ip, const char *buf, unsigned int len)
+{
+    uint32 net = 0;
+    uint64 id = 0, ms = 0;
+    struct taia now;
+    struct bucket *e = 0;
+    char key[4 + 1 + 255];
+    const char *dn = NULL;
+    unsigned int n = 0, rcode = 0, ancount = 0;
+
+    if (!rrl_rate || len < 12)
+        return RRL_SEND;
+
+    uint32_unpack_big (ip, &net);
+    uint32_pack_big (key, net & rrl_mask);
+
+    rcode = buf[3] & 15;
+    ancount = ((unsigned char)buf[6] << 8) + (unsigned char)buf[7];
+    if (rcode == 3)
+        key[4] = KIND_NXDOMAIN;
+    else if (rcode)
+        key[4] = KIND_ERROR;
+    else
+        key[4] = ancount ? KIND_ANSWER : KIND_NODATA;
+
+    n = 5;
+    if (key[4] != KIND_ERROR)
+    {
+        if (key[4] == KIND_ANSWER || !(dn = zone (buf, len)))
+            dn = (len > 12) ? buf + 12 : "";
+        n += dns_domain_length (dn);
+        if (n > sizeof (key))
+            n = sizeof (key);
+        byte_copy (key + 5, n - 5, dn);
+        case_lowerb (key + 5, n - 5);
+    }
+    siphash24 ((unsigned char *)&id, (const unsigned char *)key, n, rrl_key);
+    if (!id)
+        id = 1;
+
+    taia_now (&now);
+    ms = now.sec.x * 1000 + now.nano / 1000000;
+    e = find (id);
+    if (e->stamp && ms > e->stamp)
+    {
+        e->tokens += (ms - e->stamp) * rrl_rate;
+        if (e->tokens > (uint64)rrl_rate * 1000)
+            e->tokens = (uint64)rrl_rate * 1000;
+    }
+    e->stamp = ms;
+
+    if (e->tokens >= 1000)
+    {
+        e->tokens -= 1000;
+        return RRL_SEND;
+    }
+    if (rrl_slip && ++e->slips % rrl_slip == 0)
+    {
+        rrl_slipped++;
+        return RRL_SLIP;
+    }
+    rrl_limited++;
+
+    return RRL_DROP;
+}
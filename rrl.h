@@ -0,0 +1,14 @@
+#pragma once
+
+#include "uint64.h"
+
+#define RRL_SEND 0                  /* send the response as it is */
+#define RRL_DROP 1                  /* send nothing */
+#define RRL_SLIP 2                  /* send it truncated */
+
+extern uint64 rrl_limited;
+extern uint64 rrl_slipped;
+
+extern void rrl_init (unsigned int, unsigned int, unsigned int);
+
+extern int rrl_check (const char *, const char *, unsigned int);
@@ -38,12 +38,15 @@
 #include "ip4.h"
 #include "dns.h"
 #include "log.h"
+#include "rrl.h"
 #include "byte.h"
 #include "case.h"
+#include "error.h"
 #include "buffer.h"
 #include "strerr.h"
 #include "uint16.h"
 #include "ndelay.h"
+#include "scan.h"
 #include "socket.h"
 #include "common.h"
 #include "iopause.h"
@@ -51,15 +54,16 @@
 #include "response.h"
 
 extern void initialize (void);
-extern int respond (char *, char *, char *);
+extern int respond (struct response *, char *, char *, char *);
 
 static char ip[4];
 static uint16 port;
 static uint16 server_port = 53;
 
 static int len;
-static char *q;
+static char q[255];
 static char buf[1024];
+static struct response resp;
 
 static char *prog = NULL;
 short mode = 0, debug_level = 0;
@@ -153,7 +157,7 @@ check_option (int argc, char *argv[])
 static unsigned long long qnum = 0;
 
 static int
-doit (void)
+doit (struct response *r)
 {
     char qtype[2];
     char qclass[2];
@@ -171,25 +175,25 @@ doit (void)
     if (header[5] != 1)
         goto NOQ;
 
-    if (!(pos = dns_packet_getname (buf, len, pos, &q)))
+    if (!(pos = dns_packet_copyname (buf, len, pos, q)))
         goto NOQ;
     if (!(pos = dns_packet_copy (buf, len, pos, qtype, 2)))
         goto NOQ;
     if (!(pos = dns_packet_copy (buf, len, pos, qclass, 2)))
         goto NOQ;
 
-    if (!response_query (q, qtype, qclass))
+    if (!response_query (r, q, qtype, qclass))
         goto NOQ;
-    response_id (header);
+    response_id (r, header);
 
     qnum++;
     if (byte_equal (qclass, 2, DNS_C_IN))
-        response[2] |= 4;
+        r->buf[2] |= 4;
     else if (byte_diff (qclass, 2, DNS_C_ANY))
             goto WEIRDCLASS;
-    response[3] &= ~128;
+    r->buf[3] &= ~128;
     if (!(header[2] & 1))
-        response[2] &= ~1;
+        r->buf[2] &= ~1;
 
     if (header[2] & 126)
         goto NOTIMP;
@@ -197,7 +201,7 @@ doit (void)
         goto NOTIMP;
 
     case_lowerb (q, dns_domain_length (q));
-    if (!respond (q, qtype, ip))
+    if (!respond (r, q, qtype, ip))
     {
         log_query (qnum, ip, port, header, q, qtype);
         return 0;
@@ -207,15 +211,15 @@ doit (void)
     return 1;
 
 NOTIMP:
-    response[3] &= ~15;
-    response[3] |= 4;
+    r->buf[3] &= ~15;
+    r->buf[3] |= 4;
     log_query (qnum, ip, port, header, q, qtype);
 
     return 1;
 
 WEIRDCLASS:
-    response[3] &= ~15;
-    response[3] |= 1;
+    r->buf[3] &= ~15;
+    r->buf[3] |= 1;
     log_query (qnum, ip, port, header, q, qtype);
 
     return 1;
@@ -229,9 +233,11 @@ NOQ:
 int
 main (int argc, char *argv[])
 {
-    time_t t = 0;
+    time_t t = 0, logged = 0;
     char *x = NULL;
     struct sigaction sa;
+    uint64 limited = 0, slipped = 0;
+    unsigned long rrlrate = 0, rrlslip = 2, rrlprefix = 24;
     iopause_fd *iop = NULL;
     int i = 0, n = 0, *udp53 = NULL;
 
@@ -324,6 +330,17 @@ main (int argc, char *argv[])
         i += (x[i + l] == ',') ? l + 1 : l;
     }
 
+    if ((x = env_get ("RRLRATE")))
+        rrlrate = atol (x);
+    if ((x = env_get ("RRLSLIP")))
+        rrlslip = atol (x);
+    if ((x = env_get ("RRLPREFIX")) && *x)
+    {
+        if (x[scan_ulong (x, &rrlprefix)] || rrlprefix > 32)
+            errx (-1, "RRLPREFIX `%s' is not a prefix length, 0 to 32", x);
+    }
+    rrl_init (rrlrate, rrlslip, rrlprefix);
+
     droproot ();
     while (1)
     {
@@ -344,18 +361,42 @@ main (int argc, char *argv[])
             len = socket_recv4 (udp53[i], buf, sizeof (buf), ip, &port, &odst);
             if (len < 0)
                 continue;
-            if (!doit ())
+            if (!doit (&resp))
+                continue;
+            if (resp.len > 512)
+                response_tc (&resp);
+
+            switch (rrl_check (ip, resp.buf, resp.len))
+            {
+            case RRL_DROP:
+                errno = error_ratelimit;
+                if (debug_level > 1)
+                    log_querydrop (qnum);
                 continue;
-            if (response_len > 512)
-                response_tc ();
+
+            case RRL_SLIP:
+                /* no records: a real client asks again over TCP */
+                response_tc (&resp);
+                byte_zero (resp.buf + 6, 6);
+                break;
+            }
 
             /* may block for buffer space; if it fails, too bad */
-            len = socket_send4 (udp53[i], response,
-                                response_len, ip, port, &odst);
+            len = socket_send4 (udp53[i], resp.buf,
+                                resp.len, ip, port, &odst);
             if (len < 0)
                 continue;
             if (debug_level > 1)
-                log_querydone(qnum, response, response_len);
+                log_querydone(qnum, resp.buf, resp.len);
+        }
+
+        if (rrl_limited + rrl_slipped != limited + slipped
+            && time (&t) - logged >= 60)
+        {
+            limited = rrl_limited;
+            slipped = rrl_slipped;
+            log_rrlstats (limited, slipped);
+            logged = t;
         }
     }
 
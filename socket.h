@@ -30,8 +30,16 @@ extern int socket_udp (void);
 
 extern int socket_connected (int);
 
+extern int socket_disconnect (int);
+
 extern int socket_listen (int, int);
 
+extern int socket_fastopen (int, int);
+
+extern int socket_fastopened (int);
+
+extern int socket_fastopenconnect (int);
+
 extern void socket_tryreservein (int, int);
 
 extern int socket_bind4 (int, char *, uint16);
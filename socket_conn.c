@@ -2,8 +2,10 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include "byte.h"
+#include "error.h"
 #include "socket.h"
 
 int socket_connect4(int s,const char ip[4],uint16 port)
@@ -18,6 +20,15 @@ int socket_connect4(int s,const char ip[4],uint16 port)
   return connect(s,(struct sockaddr *) &sa,sizeof sa);
 }
 
+int socket_disconnect(int s)
+{
+  struct sockaddr sa;
+
+  byte_zero(&sa,sizeof sa);
+  sa.sa_family = AF_UNSPEC;
+  return connect(s,&sa,sizeof sa);
+}
+
 int socket_connected(int s)
 {
   struct sockaddr_in sa;
@@ -31,3 +42,28 @@ int socket_connected(int s)
   }
   return 1;
 }
+
+int socket_fastopenconnect(int s)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+  int opt = 1;
+  return setsockopt(s,IPPROTO_TCP,TCP_FASTOPEN_CONNECT,&opt,sizeof opt);
+#else
+  errno = error_proto;
+  return -1;
+#endif
+}
+
+int socket_fastopened(int s)
+{
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+  struct tcp_info ti;
+  socklen_t len;
+
+  len = sizeof ti;
+  if (getsockopt(s,IPPROTO_TCP,TCP_INFO,&ti,&len) == -1) return 0;
+  return (ti.tcpi_options & TCPI_OPT_SYN_DATA) ? 1 : 0;
+#else
+  return 0;
+#endif
+}
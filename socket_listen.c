@@ -2,9 +2,21 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "error.h"
 #include "socket.h"
 
 int socket_listen(int s,int backlog)
 {
   return listen(s,backlog);
 }
+
+int socket_fastopen(int s,int qlen)
+{
+#ifdef TCP_FASTOPEN
+  return setsockopt(s,IPPROTO_TCP,TCP_FASTOPEN,&qlen,sizeof qlen);
+#else
+  errno = error_proto;
+  return -1;
+#endif
+}
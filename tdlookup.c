@@ -35,24 +35,24 @@
 #include "response.h"
 
 static int
-want (const char *owner, const char type[2])
+want (struct response *r, const char *owner, const char type[2])
 {
     char x[10];
-    static char *d;
+    char d[255];
     uint16 datalen;
     unsigned int pos;
 
-    pos = dns_packet_skipname (response, response_len, 12);
+    pos = dns_packet_skipname (r->buf, r->len, 12);
     if (!pos)
         return 0;
     pos += 4;
 
-    while (pos < response_len)
+    while (pos < r->len)
     {
-        pos = dns_packet_getname (response, response_len, pos, &d);
+        pos = dns_packet_copyname (r->buf, r->len, pos, d);
         if (!pos)
             return 0;
-        pos = dns_packet_copy (response, response_len, pos, x, 10);
+        pos = dns_packet_copy (r->buf, r->len, pos, x, 10);
         if (!pos)
             return 0;
         if (dns_domain_equal (d, owner))
@@ -66,7 +66,7 @@ want (const char *owner, const char type[2])
     return 1;
 }
 
-static char *d1;
+static char d1[255];
 static struct cdb c;
 static struct tai now;
 static char clientloc[2];
@@ -150,7 +150,7 @@ find (char *d, int flagwild)
 }
 
 static int
-dobytes (unsigned int len)
+dobytes (struct response *r, unsigned int len)
 {
     char buf[20];
 
@@ -160,21 +160,21 @@ dobytes (unsigned int len)
     if (!dpos)
         return 0;
 
-    return response_addbytes (buf, len);
+    return response_addbytes (r, buf, len);
 }
 
 static int
-doname (void)
+doname (struct response *r)
 {
-    dpos = dns_packet_getname (data, dlen, dpos, &d1);
+    dpos = dns_packet_copyname (data, dlen, dpos, d1);
     if (!dpos)
         return 0;
 
-    return response_addname (d1);
+    return response_addname (r, d1);
 }
 
 static int
-doit (char *q, char qtype[2])
+doit (struct response *r, char *q, char qtype[2])
 {
     char x[20];
     char addr[8][4];
@@ -188,21 +188,21 @@ doit (char *q, char qtype[2])
     unsigned int aupos;
     unsigned int arpos;
 
-    int r, i, addrnum;
+    int f, i, addrnum;
     int flaggavesoa, flagfound;
     int flagns, flagauthoritative;
 
     control = q;
-    anpos = response_len;
+    anpos = r->len;
     for (;;)
     {
         flagns = 0;
         flagauthoritative = 0;
 
         cdb_findstart (&c);
-        while ((r = find (control, 0)))
+        while ((f = find (control, 0)))
         {
-            if (r == -1)
+            if (f == -1)
                 return 0;
             if (byte_equal (type, 2, DNS_T_SOA))
                 flagauthoritative = 1;
@@ -219,7 +219,7 @@ doit (char *q, char qtype[2])
     }
     if (!flagauthoritative)
     {
-        response[2] &= ~4;
+        r->buf[2] &= ~4;
         goto AUTHORITY; /* q is in a child zone */
     }
 
@@ -231,9 +231,9 @@ doit (char *q, char qtype[2])
         addrnum = 0;
         addrttl = 0;
         cdb_findstart (&c);
-        while ((r = find (wild, wild != q)))
+        while ((f = find (wild, wild != q)))
         {
-            if (r == -1)
+            if (f == -1)
                 return 0;
 
             flagfound = 1;
@@ -260,48 +260,48 @@ doit (char *q, char qtype[2])
                 continue;
             }
 
-            if (!response_rstart (q, type, ttl))
+            if (!response_rstart (r, q, type, ttl))
                 return 0;
             if (byte_equal (type, 2, DNS_T_NS)
                 || byte_equal (type, 2, DNS_T_CNAME)
                 || byte_equal (type, 2, DNS_T_PTR))
             {
-                if (!doname ())
+                if (!doname (r))
                     return 0;
             }
             else if (byte_equal (type, 2, DNS_T_MX))
             {
-                if (!dobytes (2))
+                if (!dobytes (r, 2))
                     return 0;
-                if (!doname ())
+                if (!doname (r))
                     return 0;
             }
             else if (byte_equal (type, 2, DNS_T_SOA))
             {
-                if (!doname ())
+                if (!doname (r))
                     return 0;
-                if (!doname ())
+                if (!doname (r))
                     return 0;
-                if (!dobytes (20))
+                if (!dobytes (r, 20))
                     return 0;
                 flaggavesoa = 1;
             }
             else
-                if (!response_addbytes (data + dpos, dlen - dpos))
+                if (!response_addbytes (r, data + dpos, dlen - dpos))
                     return 0;
 
-            response_rfinish (RESPONSE_ANSWER);
+            response_rfinish (r, RESPONSE_ANSWER);
         }
 
         for (i = 0; i < addrnum; ++i)
         {
             if (i < 8)
             {
-                if (!response_rstart (q, DNS_T_A, addrttl))
+                if (!response_rstart (r, q, DNS_T_A, addrttl))
                     return 0;
-                if (!response_addbytes (addr[i], 4))
+                if (!response_addbytes (r, addr[i], 4))
                     return 0;
-                response_rfinish (RESPONSE_ANSWER);
+                response_rfinish (r, RESPONSE_ANSWER);
             }
         }
         if (flagfound)
@@ -314,59 +314,59 @@ doit (char *q, char qtype[2])
         wild += 1;
     }
     if (!flagfound)
-        response_nxdomain ();
+        response_nxdomain (r);
 
 AUTHORITY:
-    aupos = response_len;
+    aupos = r->len;
 
     if (flagauthoritative && (aupos == anpos))
     {
         cdb_findstart (&c);
-        while ((r = find (control, 0)))
+        while ((f = find (control, 0)))
         {
-            if (r == -1)
+            if (f == -1)
                 return 0;
             if (byte_equal (type, 2, DNS_T_SOA))
             {
-                if (!response_rstart (control, DNS_T_SOA, ttl))
+                if (!response_rstart (r, control, DNS_T_SOA, ttl))
                     return 0;
-                if (!doname ())
+                if (!doname (r))
                     return 0;
-                if (!doname ())
+                if (!doname (r))
                     return 0;
-                if (!dobytes (20))
+                if (!dobytes (r, 20))
                     return 0;
-                response_rfinish (RESPONSE_AUTHORITY);
+                response_rfinish (r, RESPONSE_AUTHORITY);
                 break;
             }
         }
     }
-    else if (want (control, DNS_T_NS))
+    else if (want (r, control, DNS_T_NS))
     {
         cdb_findstart (&c);
-        while ((r = find (control, 0)))
+        while ((f = find (control, 0)))
         {
-            if (r == -1)
+            if (f == -1)
                 return 0;
             if (byte_equal (type, 2, DNS_T_NS))
             {
-                if (!response_rstart (control, DNS_T_NS, ttl))
+                if (!response_rstart (r, control, DNS_T_NS, ttl))
                     return 0;
-                if (!doname ())
+                if (!doname (r))
                     return 0;
-                response_rfinish (RESPONSE_AUTHORITY);
+                response_rfinish (r, RESPONSE_AUTHORITY);
             }
         }
     }
 
     bpos = anpos;
-    arpos = response_len;
+    arpos = r->len;
     while (bpos < arpos)
     {
-        bpos = dns_packet_skipname (response, arpos, bpos);
+        bpos = dns_packet_skipname (r->buf, arpos, bpos);
         if (!bpos)
             return 0;
-        bpos = dns_packet_copy (response, arpos, bpos, x, 10);
+        bpos = dns_packet_copy (r->buf, arpos, bpos, x, 10);
         if (!bpos)
             return 0;
         if (byte_equal (x, 2, DNS_T_NS)
@@ -374,27 +374,27 @@ AUTHORITY:
         {
             if (byte_equal (x, 2, DNS_T_NS))
             {
-                if (!dns_packet_getname (response, arpos, bpos, &d1))
+                if (!dns_packet_copyname (r->buf, arpos, bpos, d1))
                     return 0;
             }
-            else if (!dns_packet_getname (response, arpos, bpos + 2, &d1))
+            else if (!dns_packet_copyname (r->buf, arpos, bpos + 2, d1))
                 return 0;
 
             case_lowerb (d1, dns_domain_length (d1));
-            if (want (d1, DNS_T_A))
+            if (want (r, d1, DNS_T_A))
             {
                 cdb_findstart(&c);
-                while ((r = find (d1, 0)))
+                while ((f = find (d1, 0)))
                 {
-                    if (r == -1)
+                    if (f == -1)
                         return 0;
                     if (byte_equal (type, 2, DNS_T_A))
                     {
-                        if (!response_rstart (d1, DNS_T_A, ttl))
+                        if (!response_rstart (r, d1, DNS_T_A, ttl))
                             return 0;
-                        if (!dobytes (4))
+                        if (!dobytes (r, 4))
                             return 0;
-                        response_rfinish (RESPONSE_ADDITIONAL);
+                        response_rfinish (r, RESPONSE_ADDITIONAL);
                     }
                 }
             }
@@ -403,14 +403,14 @@ AUTHORITY:
         bpos += u16;
     }
 
-    if (flagauthoritative && (response_len > 512))
+    if (flagauthoritative && (r->len > 512))
     {
-        byte_zero (response + RESPONSE_ADDITIONAL, 2);
-        response_len = arpos;
-        if (response_len > 512)
+        byte_zero (r->buf + RESPONSE_ADDITIONAL, 2);
+        r->len = arpos;
+        if (r->len > 512)
         {
-            byte_zero(response + RESPONSE_AUTHORITY,2);
-            response_len = aupos;
+            byte_zero(r->buf + RESPONSE_AUTHORITY,2);
+            r->len = aupos;
         }
     }
 
@@ -418,7 +418,7 @@ AUTHORITY:
 }
 
 int
-respond (char *q, char qtype[2], char ip[4])
+respond (struct response *res, char *q, char qtype[2], char ip[4])
 {
     int r;
     char key[6];
@@ -431,15 +431,19 @@ respond (char *q, char qtype[2], char ip[4])
     if (tai_less (&cdb_valid, &now))
     {
         if (fd != -1)
+        {
+            cdb_free (&c);
             close (fd);
+        }
 
-        fd = open_read ("data.cdb");
-        if (fd == -1)
-            return 0;
-
-        cdb_init (&c, fd);
+        /* a missing file too is tried again only once the step is over */
         tai_add (&cdb_valid, &now, &step);
+        fd = open_read ("data.cdb");
+        if (fd != -1)
+            cdb_init (&c, fd);
     }
+    if (fd == -1)
+        return 0;
 
     byte_zero (clientloc, 2);
     key[0] = 0;
@@ -461,6 +465,6 @@ respond (char *q, char qtype[2], char ip[4])
         && (cdb_read (&c, clientloc, 2, cdb_datapos (&c)) == -1))
             return 0;
 
-    r = doit (q, qtype);
+    r = doit (res, q, qtype);
     return r;
 }
@@ -44,7 +44,9 @@
 #include "printpacket.h"
 
 static char *prog = NULL;
-extern int respond (char *, char *, char *);
+extern int respond (struct response *, char *, char *, char *);
+
+static struct response resp;
 
 void
 usage (void)
@@ -149,23 +151,23 @@ main (int argc, char *argv[])
     if (!stralloc_cats (&out, ":\n"))
         err (-1, "could not parse input");
 
-    if (!response_query (q, type, DNS_C_IN))
+    if (!response_query (&resp, q, type, DNS_C_IN))
         err (-1, "could not parse input");
 
-    response[3] &= ~128;
-    response[2] &= ~1;
-    response[2] |= 4;
+    resp.buf[3] &= ~128;
+    resp.buf[2] &= ~1;
+    resp.buf[2] |= 4;
     case_lowerb (q, dns_domain_length (q));
 
     if (byte_equal (type, 2, DNS_T_AXFR))
     {
-        response[3] &= ~15;
-        response[3] |= 4;
+        resp.buf[3] &= ~15;
+        resp.buf[3] |= 4;
     }
-    else if (!respond (q, type, ip))
+    else if (!respond (&resp, q, type, ip))
         goto DONE;
 
-    if (!printpacket_cat (&out, response, response_len))
+    if (!printpacket_cat (&out, resp.buf, resp.len))
         err (-1, "could not parse input");
 
 DONE:
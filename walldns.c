@@ -52,13 +52,15 @@ initialize (void)
 }
 
 int
-respond (char *q, char qtype[2])
+respond (struct response *r, char *q, char qtype[2], char client[4])
 {
     int j = 0;
     char ip[4];
     int flaga = 0;
     int flagptr = 0;
 
+    (void) client;
+
     flaga = byte_equal (qtype, 2, DNS_T_A);
     flagptr = byte_equal (qtype, 2, DNS_T_PTR);
     if (byte_equal (qtype, 2, DNS_T_ANY))
@@ -70,11 +72,11 @@ respond (char *q, char qtype[2])
         {
             if (flaga)
             {
-                if (!response_rstart (q, DNS_T_A, 655360))
+                if (!response_rstart (r, q, DNS_T_A, 655360))
                     return 0;
-                if (!response_addbytes (ip, 4))
+                if (!response_addbytes (r, ip, 4))
                     return 0;
-                response_rfinish (RESPONSE_ANSWER);
+                response_rfinish (r, RESPONSE_ANSWER);
             }
             return 1;
         }
@@ -83,32 +85,32 @@ respond (char *q, char qtype[2])
         {
             if (flaga && (j == 4))
             {
-                if (!response_rstart (q, DNS_T_A, 655360))
+                if (!response_rstart (r, q, DNS_T_A, 655360))
                     return 0;
-                if (!response_addbytes (ip + 3, 1))
+                if (!response_addbytes (r, ip + 3, 1))
                     return 0;
-                if (!response_addbytes (ip + 2, 1))
+                if (!response_addbytes (r, ip + 2, 1))
                     return 0;
-                if (!response_addbytes (ip + 1, 1))
+                if (!response_addbytes (r, ip + 1, 1))
                     return 0;
-                if (!response_addbytes (ip + 0, 1))
+                if (!response_addbytes (r, ip + 0, 1))
                     return 0;
-                response_rfinish (RESPONSE_ANSWER);
+                response_rfinish (r, RESPONSE_ANSWER);
             }
             if (flagptr)
             {
-                if (!response_rstart (q, DNS_T_PTR, 655360))
+                if (!response_rstart (r, q, DNS_T_PTR, 655360))
                     return 0;
-                if (!response_addname (q))
+                if (!response_addname (r, q))
                     return 0;
-                response_rfinish (RESPONSE_ANSWER);
+                response_rfinish (r, RESPONSE_ANSWER);
             }
             return 1;
         }
     }
 
-    response[2] &= ~4;
-    response[3] &= ~15;
-    response[3] |= 5;
+    r->buf[2] &= ~4;
+    r->buf[3] &= ~15;
+    r->buf[3] |= 5;
     return 1;
 }
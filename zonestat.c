@@ -0,0 +1,197 @@
+/*
+ * zonestat.c: This file is part of the `ndjbdns' project.
+ *
+ * Copyright (C) 2015 Prasad J Pandit
+ *
+ * This program is a free software; you can redistribute it and/or modify
+ * it under the terms of GNU General Public License as published by Free
+ * Software Foundation; either version 2 of the license or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * of FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "dns.h"
+#include "byte.h"
+#include "taia.h"
+#include "case.h"
+#include "uint32.h"
+#include "uint64.h"
+#include "siphash.h"
+#include "zonestat.h"
+
+/*
+ * Per zone statistics: how many queries dnscache has outstanding to the
+ * servers of each zone, and how often those servers have recently said
+ * that a name does not exist. Zones are identified by a keyed hash of their
+ * lower-cased name and kept in a small set-associative table. When a set is
+ * full, the least recently used zone with no queries outstanding is
+ * forgotten; if there is none the new zone simply goes uncounted.
+ *
+ * The NXDOMAIN count is halved every second, so in a steady state it is
+ * about twice the number of NXDOMAIN answers per second. A zone whose count
+ * exceeds twice the configured rate is being flooded with queries for
+ * random names, as in a `water torture' attack: its names are not looked
+ * up until the count decays again. Names already in the cache are not
+ * affected.
+ */
+
+#define ZONE_WAYS 4
+#define ZONE_SLOTS 4096             /* power of 2 */
+
+struct zone
+{
+    uint64 id;                      /* 0 if the slot is free */
+    uint32 inflight;                /* queries outstanding */
+    uint32 nx;                      /* recent NXDOMAIN answers */
+    uint64 stamp;                   /* second of last use */
+};
+
+static struct zone zone[ZONE_SLOTS];
+static unsigned char zone_key[16];
+static unsigned int zone_max;
+static unsigned int zone_nxrate;
+uint64 zone_capped = 0;             /* queries not sent due to the limit */
+uint64 zone_flooded = 0;            /* queries not sent due to NXDOMAINs */
+
+/*
+ * zone_init: allow at most `max' queries outstanding per zone and `nxrate'
+ * NXDOMAIN answers per second from its servers; 0 for no limit.
+ */
+void
+zone_init (unsigned int max, unsigned int nxrate)
+{
+    unsigned int i = 0;
+
+    for (i = 0; i < sizeof (zone_key); i++)
+        zone_key[i] = (unsigned char) dns_random (0x100);
+
+    zone_max = max;
+    zone_nxrate = nxrate;
+}
+
+uint64
+zone_id (const char *control)
+{
+    uint64 h = 0;
+    char buf[255];
+    unsigned int len = dns_domain_length (control);
+
+    if (len > sizeof (buf))
+        len = sizeof (buf);
+    byte_copy (buf, len, control);
+    case_lowerb (buf, len);
+    siphash24 ((unsigned char *)&h, (const unsigned char *)buf, len, zone_key);
+
+    return h ? h : 1;
+}
+
+static struct zone *
+zone_find (uint64 id, int create)
+{
+    uint64 sec = 0;
+    struct taia now;
+    unsigned int i = 0;
+    struct zone *e = zone + (id & (ZONE_SLOTS - ZONE_WAYS)), *old = 0;
+
+    taia_now (&now);
+    sec = now.sec.x;
+    for (i = 0; i < ZONE_WAYS; i++)
+    {
+        if (e[i].id == id)
+        {
+            old = e + i;
+            break;
+        }
+        if (e[i].inflight)
+            continue;
+        if (!old || !e[i].id || (old->id && e[i].stamp < old->stamp))
+            old = e + i;
+    }
+    if (!old)
+        return 0;
+
+    if (old->id != id)
+    {
+        if (!create)
+            return 0;
+        byte_zero (old, sizeof (*old));
+        old->id = id;
+    }
+    else if (sec - old->stamp >= 32)
+        old->nx = 0;
+    else
+        old->nx >>= sec - old->stamp;
+    old->stamp = sec;
+
+    return old;
+}
+
+/*
+ * zone_hold: count a query going out to the servers of zone `id'. Returns 0,
+ * and counts nothing, if the zone already has the maximum number of queries
+ * outstanding. Every successful hold must be paired with zone_release.
+ */
+int
+zone_hold (uint64 id)
+{
+    struct zone *e = 0;
+
+    if (!zone_max)
+        return 1;
+    if (!(e = zone_find (id, 1)))
+        return 1;
+    if (e->inflight >= zone_max)
+    {
+        zone_capped++;
+        return 0;
+    }
+    e->inflight++;
+
+    return 1;
+}
+
+void
+zone_release (uint64 id)
+{
+    struct zone *e = 0;
+
+    if (!zone_max)
+        return;
+    if ((e = zone_find (id, 0)) && e->inflight)
+        e->inflight--;
+}
+
+/* zone_nxdomain: a server of zone `id' said that a name does not exist */
+void
+zone_nxdomain (uint64 id)
+{
+    struct zone *e = 0;
+
+    if (!zone_nxrate)
+        return;
+    if ((e = zone_find (id, 1)) && e->nx < 0xffffffff)
+        e->nx++;
+}
+
+/* zone_flood: return 1 if zone `id' is answering NXDOMAIN too often */
+int
+zone_flood (uint64 id)
+{
+    struct zone *e = 0;
+
+    if (!zone_nxrate)
+        return 0;
+    if (!(e = zone_find (id, 0)) || e->nx <= 2 * zone_nxrate)
+        return 0;
+
+    zone_flooded++;
+    return 1;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "uint64.h"
+
+extern uint64 zone_capped;
+extern uint64 zone_flooded;
+
+extern void zone_init (unsigned int, unsigned int);
+
+extern uint64 zone_id (const char *);
+
+extern int zone_hold (uint64);
+
+extern void zone_release (uint64);
+
+extern void zone_nxdomain (uint64);
+
+extern int zone_flood (uint64);